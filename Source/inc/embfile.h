@@ -0,0 +1,42 @@
+#include <stddef.h>
+
+// Indexed embedding file (.emb), meant to be mapped and used in place:
+//   EMBHDR
+//   matrix: rows x dim values of the dtype, row-major, starting on a 64-byte boundary
+//   string table: rows + 1 offsets (unsigned long long, relative to the string bytes) then the NUL-terminated words
+//   hash index: index_slots (a power of two) unsigned ints holding row + 1, or 0 for an empty slot;
+//               a word is looked up from slot embHash(word) & (index_slots - 1) with linear probing
+// All numbers are little-endian.
+#define EMB_DTYPE_FLOAT32 1
+#define EMB_DTYPE_FLOAT64 2
+#define EMB_ALIGN 64
+
+typedef struct emb_file_header {
+	char magic[8]; // "GLVEMB1"
+	int dtype;
+	int model; // -model of glove_imbue: 0: word and context vectors with biases; 1: word vectors; 2: word + context vectors
+	long long rows; // Words, including <unk> if it was written
+	int dim; // Values per row: 2 * (vector_size + 1) for model 0, vector_size otherwise
+	int vector_size;
+	long long matrix_offset, strings_offset, index_offset; // From the start of the file
+	long long index_slots;
+	long long reserved[2];
+} EMBHDR;
+
+typedef struct emb_file {
+	const EMBHDR *header;
+	const char *matrix;
+	const unsigned long long *string_offsets;
+	const char *strings;
+	const unsigned int *index;
+	size_t row_bytes, size;
+} EMBFILE;
+
+unsigned long long embHash(const char*);
+// Map an .emb file; NULL if it cannot be opened or is not one
+EMBFILE *openEmbFile(const char*);
+void closeEmbFile(EMBFILE*);
+// Row of a word, or -1 if it is not in the file
+long long embLookup(const EMBFILE*, const char*);
+const void *embRow(const EMBFILE*, long long);
+const char *embWord(const EMBFILE*, long long);
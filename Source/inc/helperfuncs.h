@@ -1,5 +1,34 @@
+#include <stdio.h>
+
+#ifdef SINGLE_PRECISION
+typedef float real; // Single-precision training build (make PRECISION=single)
+#else
 typedef double real;
+#endif
 
 real dot(real*, real*, int);
 real recipCost(real, real, real);
 real recipCostDer(real, real, real);
+// Implicit (proximal) step of a given size on the forced term of one component
+real recipCostProx(real, real, real, real);
+
+// Fused dot product + AdaGrad update of a word row and a context row (biases at index size); returns dot + biases - logx
+real adagradStep(real*, real*, real*, real*, int, real, real, real);
+const char* adagradStepInit(const char*);
+
+// Parameter files always hold doubles, whatever the precision of real
+long long readReals(real*, long long, FILE*);
+long long writeReals(real*, long long, FILE*);
+
+// Text form of a parameter value: as printf("%lf") does, or the shortest one that reads back to the same real; returns its length
+#define MAX_REAL_TEXT 320 // Room for any of them, with its NUL: printf("%lf") of -DBL_MAX has 317 characters
+int formatReal(char*, real, int);
+
+// Counter-based random numbers (Philox4x32-10): four words from a 128-bit counter and a 64-bit key
+void philox4x32(const unsigned int*, const unsigned int*, unsigned int*);
+// Random initial values of row r of W for a seed; independent of the order in which rows are filled
+void initRandomRow(real*, int, long long, unsigned long long);
+
+// 64-bit FNV-1a of some bytes, chained through h: start from FNV1A_BASIS (hash of the .emb index and of the forcing data)
+#define FNV1A_BASIS 14695981039346656037ULL
+unsigned long long fnv1a(const void*, size_t, unsigned long long);
@@ -0,0 +1,64 @@
+#include <stdio.h>
+
+// Cooccurrence record files. The original format, as written by cooccur and shuffle, is a bare
+// array of {int word1; int word2; double val} records. Every other format starts with a RECHDR.
+#define RECFMT_CREC 0 // No header; 16-byte records of ids and cooccurrence count
+#define RECFMT_TRAIN 1 // TREC records, with log X and f(X) computed for the x_max and alpha in the header
+#define RECFMT_COMPACT 2 // CRECF records: ids and the count as a float, 12 bytes
+#define RECFMT_BLOCK 3 // Blocks of CRECF records with delta/varint-coded ids, each decodable on its own
+#define RECBLOCK_RECORDS 16384 // Records per block written
+#define RECBLOCK_MAX_BYTES(n) ((n) * (5 + 5 + sizeof(float))) // Payload bound for a block of n records
+
+typedef struct record_file_header {
+	char magic[6]; // "GLVREC"
+	short format;
+	float x_max, alpha; // Weighting function the records were precomputed with (RECFMT_TRAIN only)
+} RECHDR;
+
+typedef struct training_rec {
+	int word1;
+	int word2;
+	float logx; // log X
+	float fx; // f(X) = min(1, (X/x_max)^alpha)
+} TREC;
+
+typedef struct cooccur_rec_float {
+	int word1;
+	int word2;
+	float val;
+} CRECF;
+
+typedef struct record_block_header { // Precedes the payload of every block of a RECFMT_BLOCK file
+	int records;
+	int bytes;
+} RECBLOCKHDR;
+
+// Reads sizeof(RECHDR) bytes and returns the format, or -1 if the stream is shorter than that.
+// For RECFMT_CREC nothing was a header: the bytes read, left in the RECHDR, are the first record.
+int readRecordHeader(FILE*, RECHDR*);
+int writeRecordHeader(FILE*, int, float, float);
+// Size of one record of the format; 0 if unknown
+long recordSize(int);
+int formatFromName(const char*);
+
+// Block payload coding; both return the number of payload bytes
+int encodeRecordBlock(const CRECF*, int, unsigned char*);
+int decodeRecordBlock(const unsigned char*, int, CRECF*);
+
+// Buffered sequential reading or writing of (word1, word2, count) in any format except RECFMT_TRAIN
+typedef struct record_stream {
+	FILE *f;
+	int format;
+	int count, pos; // Records in the buffer and the next one to return or fill
+	void *recs; // count records, as 16-byte {int, int, double}
+	CRECF *packed;
+	unsigned char *bytes;
+} RECSTREAM;
+
+// The writer starts with the header of the format, the reader detects it; the reader returns NULL on an unsupported format
+RECSTREAM *openRecordWriter(FILE*, int);
+RECSTREAM *openRecordReader(FILE*);
+int putRecord(RECSTREAM*, int, int, double);
+int getRecord(RECSTREAM*, int*, int*, double*); // 1 if a record was read, 0 at the end
+int closeRecordWriter(RECSTREAM*); // Flushes the buffer; the file stays open
+void closeRecordReader(RECSTREAM*);
@@ -0,0 +1,30 @@
+#include <stdio.h>
+
+// Word reader for the corpus tools: maps the input when it is a regular file, otherwise reads it in large buffers
+#define TOKEN_GETWORD 0 // As cooccur always read words: they end at ' ', '\t' or '\n', CR is skipped, each '\n' is reported as a line break,
+                        // a longer word keeps its first max_length - 2 characters, and a last word with no white space after it is dropped
+#define TOKEN_SCANF 1 // As fscanf("%<max_length>s"): words end at any isspace() character and a longer word is split into max_length pieces
+
+#define TOKEN_END 0
+#define TOKEN_WORD 1
+#define TOKEN_NEWLINE 2 // TOKEN_GETWORD only
+
+// Scanner of the inside of a word, chosen for the CPU when a reader is opened
+typedef long long (*wordRunFn)(const unsigned char*, long long);
+
+typedef struct token_reader {
+	FILE *f; // NULL for text given in memory
+	int mode, max_length;
+	const char *text; // Mapped file, read buffer or the given text
+	char *buf;
+	long long pos, end, size;
+	long long mapped; // Bytes mapped, 0 when not mapped
+	long long bytes; // Bytes of input taken in so far
+	wordRunFn wordRun;
+} TOKENREADER;
+
+TOKENREADER *openTokenReader(FILE*, int, int);
+TOKENREADER *openTokenText(const char*, long long, int, int);
+// Reads the next word into word, which has room for max_length + 1 bytes; returns TOKEN_WORD, TOKEN_NEWLINE or TOKEN_END
+int readToken(TOKENREADER*, char*);
+void closeTokenReader(TOKENREADER*);
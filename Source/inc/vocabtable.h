@@ -0,0 +1,16 @@
+#include "wordhash.h"
+
+// Vocabulary (vocab_count output: one "word count" pair per line, most frequent first) loaded in one read.
+// The words are interned in a WORDHASH, the value of each entry being the rank of the word.
+typedef struct vocab_table {
+	long long size; // Words, ranked 1..size in file order
+	char **words; // Word of rank r at words[r - 1], in the arena of hash
+	long long *counts; // Count of rank r at counts[r - 1]
+	WORDHASH *hash;
+} VOCABTABLE;
+
+// NULL if the file cannot be read
+VOCABTABLE *loadVocab(const char*);
+void freeVocab(VOCABTABLE*);
+// Rank of a word, or 0 if it is not in the vocabulary; several threads can look words up at once
+int vocabRank(const VOCABTABLE*, const char*);
@@ -0,0 +1,26 @@
+// Growing set of words for the corpus tools: open addressing over a flat slot array, strings interned in an arena.
+// Entries keep the order in which the words were first added; each holds a value for the caller (a count, a rank).
+typedef struct word_entry {
+	char *word; // In the arena, NUL-terminated; never moves
+	long long value;
+	unsigned long long hash;
+} WORDENTRY;
+
+typedef struct word_hash {
+	long long size; // Entries in use
+	long long capacity;
+	WORDENTRY *entries;
+	unsigned long long *slots; // High 32 bits of the hash, then entry index + 1 in the low 32 bits; 0 for an empty slot
+	long long num_slots; // Power of two, kept at least twice size; linear probing
+	char **blocks; // Arena blocks, the last one being filled
+	int num_blocks;
+	long long block_used, block_size;
+} WORDHASH;
+
+unsigned long long wordHash(const char*, long long);
+WORDHASH *newWordHash(long long);
+void freeWordHash(WORDHASH*);
+// Index of the entry of a word, which is added with value 0 if it is new
+long long wordHashAdd(WORDHASH*, const char*);
+// Index of the entry of a word, or -1; does not change the table, so several threads can search it at once
+long long wordHashFind(const WORDHASH*, const char*);
@@ -21,14 +21,25 @@
 //    GlobalVectors@googlegroups.com
 //    http://nlp.stanford.edu/projects/glove/
 
+#define _FILE_OFFSET_BITS 64 // fseeko and ftello on temporary files past 2 GB
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <limits.h>
+#include "recordfile.h"
+#include "tokenizer.h"
+#include "vocabtable.h"
 
-#define TSIZE 1048576
-#define SEED 1159241
-#define HASHFN bitwisehash
+#define BATCH_BYTES 1048576 // Text read per thread and batch when counting on several threads; its additions and overflow records are held until it is counted
+#define RADIX_BITS 11 // Digit of the radix sort of the overflow records; four passes cover two ranks of up to 22 bits
+#define RADIX_SIZE (1 << RADIX_BITS)
+#define MERGE_FAN_IN 128 // Most temporary files merged at once; more are first merged in groups into the files of a next level
+#define MERGE_MAX_OPEN 512 // Most temporary files open at once over all merging threads
+#define MERGE_BUFFER_RECORDS 65536 // Most records read at once from each file being merged
+#define MERGE_SAMPLES 256 // Records sampled from each file to split the last merge into ranges of word1
 
 static const int MAX_STRING_LENGTH = 1000;
 typedef double real;
@@ -39,18 +50,33 @@ typedef struct cooccur_rec {
     real val;
 } CREC;
 
-typedef struct cooccur_rec_id {
-    int word1;
-    int word2;
-    real val;
-    int id;
-} CRECID;
+// One sorted run being merged: a temporary file, from some record on, read through a buffer
+typedef struct merge_run {
+    FILE *f;
+    CREC *buf;
+    long long pos, count; // Next record in buf and records in buf; the run is exhausted once pos reaches count after a refill
+    long long left; // Records of the run still in the file
+} MERGERUN;
 
-typedef struct hashrec {
-    char	*word;
-    long long id;
-    struct hashrec *next;
-} HASHREC;
+// One merge of sorted runs: a group of files of a level into a file of the next, or one range of word1 of the last level
+typedef struct merge_job {
+    int level, first, num; // Input files first .. first + num - 1 of the level
+    int lo, hi; // Only the records with lo <= word1 < hi
+    char out[200]; // Output file, as CREC, unless stream is set
+    RECSTREAM *stream;
+    long long lines;
+    int status;
+} MERGEJOB;
+
+typedef struct merge_node { // A run in the loser tree, with the key of its current record
+    unsigned long long key;
+    int run;
+} MERGENODE;
+
+typedef struct merge_sample {
+    int word1;
+    long long records; // Records of the file sampled, as its weight
+} MERGESAMPLE;
 
 int verbose = 2; // 0, 1, or 2
 long long max_product; // Cutoff for product of word frequency ranks below which cooccurrence counts will be stored in a compressed full array
@@ -59,6 +85,81 @@ int window_size = 15; // default context window size
 int symmetric = 1; // 0: asymmetric, 1: symmetric
 real memory_limit = 3; // soft limit, in gigabytes, used to estimate optimal array sizes
 char *vocab_file, *file_head;
+int output_format = RECFMT_CREC; // Format of the merged output; the temporary files are always CREC
+int num_threads = 1; // Counting threads; 1 reads stdin one word at a time
+int sort_threads = 4; // Threads sorting each full overflow buffer
+int key_bits; // Bits of the largest frequency rank; records sort on word1 << key_bits | word2
+
+VOCABTABLE *vocab; // The words of vocab_file and their frequency ranks
+long long vocab_size;
+long long *lookup; // Offset of the row of each word in bigram_table
+real *bigram_table; // Cooccurrence counts of the pairs whose product of frequency ranks is below max_product
+
+// A full overflow buffer being sorted and written to its file in the background, while counting goes on in another buffer
+typedef struct spill {
+    CREC *cr; // The buffer being written, or the free one once the spill is done
+    CREC *tmp; // Scratch space of the sort
+    long long length;
+    int fid;
+    int running, status;
+    pthread_t thread;
+} SPILL;
+
+// LSD radix sort of one overflow buffer, shared by its sort_threads threads, each of which takes one slice of the records
+typedef struct radix_sort {
+    CREC *src, *dst;
+    long long length;
+    long long *counts; // Histogram of the current digit in each slice, then where the next record of each digit goes
+    int skip; // Every record has the same current digit
+    pthread_barrier_t pass;
+} RADIXSORT;
+
+typedef struct radix_part {
+    RADIXSORT *rs;
+    long long id;
+} RADIXPART;
+
+// State of one counting thread. Each thread tokenizes its own span of the batch and runs the window over it alone, starting from
+// the words of the line before the span. It keeps what it would add to bigram_table, by the thread owning the row (rank % num_threads),
+// and its overflow records, in order; once every span is counted, the owners add to their rows span by span and the records are cut
+// into the overflow files where a single-threaded run would cut them, which keeps the order of every sum exactly as in that run.
+typedef struct count_thread {
+    long long id;
+    char *text; // The span of the batch this thread counts
+    long long length;
+    int *ids; // Its in-vocabulary words (frequency ranks), 0 for each newline
+    long long num_ids, max_ids;
+    long long tokens; // Words read in the span, in the vocabulary or not
+    long long *history; // Window
+    unsigned long long **cells; // For each thread, the additions to its rows: offset in bigram_table << dist_bits | distance
+    long long *num_cells, *max_cells;
+    CREC *cr; // Overflow records of the span
+    long long num_cr, max_cr;
+    long long *ends; // Number of overflow records after each token that added some
+    long long num_ends, max_ends;
+} COUNTTHREAD;
+
+// What one span of a batch copies into an overflow file: its records from .. to - 1, at record dst of the file
+typedef struct overflow_piece {
+    long long from, to, dst;
+} OVERFLOWPIECE;
+
+COUNTTHREAD *count_threads;
+int *row_owner; // Thread that adds to the row of each word of bigram_table
+int dist_bits; // Bits of the largest distance in the window
+real *inv_dist; // Weight 1/d of each distance d in the window
+long long *line_carry, num_line_carry; // Words of the line going on at the end of the last batch (at most window_size, oldest first)
+CREC *overflow_cr; // The overflow file being filled
+long long overflow_ind; // Its number of records
+int overflow_fid; // Its number
+SPILL overflow_spill;
+OVERFLOWPIECE *pieces; // For each file a batch adds to, num_threads pieces, one per span
+long long *full_length; // Length of each file the batch completes
+int num_full, max_full; // Files the batch completes; one more is left open
+pthread_barrier_t count_phase;
+MERGEJOB *merge_jobs;
+int num_merge_jobs, merge_threads;
+long long merge_buffer; // Records read at once from each file being merged
 
 /* Efficient string comparison */
 int scmp( char *s1, char *s2 ) {
@@ -66,82 +167,12 @@ int scmp( char *s1, char *s2 ) {
     return(*s1 - *s2);
 }
 
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
-
-/* Simple bitwise hash function */
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
-    char c;
-    unsigned int h;
-    h = seed;
-    for(; (c =* word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
-    return((unsigned int)((h&0x7fffffff) % tsize));
-}
-
-/* Create hash table, initialise pointers to NULL */
-HASHREC ** inithashtable() {
-    int	i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for(i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
-    return(ht);
-}
-
-/* Search hash table for given string, return record if found, else NULL */
-HASHREC *hashsearch(HASHREC **ht, char *w) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    for(hprv = NULL, htmp=ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if( htmp != NULL && hprv!=NULL ) { // move to front on access
-        hprv->next = htmp->next;
-        htmp->next = ht[hval];
-        ht[hval] = htmp;
-    }
-    return(htmp);
-}
-
-/* Insert string in hash table, check for duplicates which should be absent */
-void hashinsert(HASHREC **ht, char *w, long long id) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    for(hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if(htmp == NULL) {
-        htmp = (HASHREC *) malloc(sizeof(HASHREC));
-        htmp->word = (char *) malloc(strlen(w) + 1);
-        strcpy(htmp->word, w);
-        htmp->id = id;
-        htmp->next = NULL;
-        if(hprv == NULL) ht[hval] = htmp;
-        else hprv->next = htmp;
-    }
-    else fprintf(stderr, "Error, duplicate entry located: %s.\n",htmp->word);
-    return;
-}
-
-/* Read word from input stream */
-int get_word(char *word, FILE *fin) {
-    int i = 0, ch;
-    while(!feof(fin)) {
-        ch = fgetc(fin);
-        if(ch == 13) continue;
-        if((ch == ' ') || (ch == '\t') || (ch == '\n')) {
-            if(i > 0) {
-                if (ch == '\n') ungetc(ch, fin);
-                break;
-            }
-            if (ch == '\n') return 1;
-            else continue;
-        }
-        word[i++] = ch;
-        if(i >= MAX_STRING_LENGTH - 1) i--;   // truncate words that exceed max length
-    }
-    word[i] = 0;
-    return 0;
-}
-
 /* Write sorted chunk of cooccurrence records to file, accumulating duplicate entries */
 int write_chunk(CREC *cr, long long length, FILE *fout) {
     long long a = 0;
-    CREC old = cr[a];
+    CREC old;
+    if(length == 0) return 0; // An empty chunk leaves an empty file
+    old = cr[a];
     
     for(a = 1; a < length; a++) {
         if(cr[a].word1 == old.word1 && cr[a].word2 == old.word2) {
@@ -155,137 +186,678 @@ int write_chunk(CREC *cr, long long length, FILE *fout) {
     return 0;
 }
 
-/* Check if two cooccurrence records are for the same two words, used for qsort */
-int compare_crec(const void *a, const void *b) {
-    int c;
-    if( (c = ((CREC *) a)->word1 - ((CREC *) b)->word1) != 0) return c;
-    else return (((CREC *) a)->word2 - ((CREC *) b)->word2);
-    
+unsigned long long crec_key(CREC *c) {
+    return ((unsigned long long)c->word1 << key_bits) | (unsigned long long)c->word2;
+}
+
+/* One thread of the radix sort: per pass, count the digits of its slice, wait for the offsets, then scatter the slice. Every pass
+   is stable, so records of the same two words stay in the order they were counted in, whatever the number of threads. */
+void *radix_sort_part(void *arg) {
+    RADIXPART *p = (RADIXPART *)arg;
+    RADIXSORT *rs = p->rs;
+    long long a, d, t, n, pos, begin = rs->length * p->id / sort_threads, finish = rs->length * (p->id + 1) / sort_threads;
+    long long *counts = rs->counts + p->id * RADIX_SIZE;
+    int shift;
+    CREC *src = rs->src, *dst = rs->dst, *swap;
+
+    for(shift = 0; shift < 2 * key_bits; shift += RADIX_BITS) {
+        memset(counts, 0, sizeof(long long) * RADIX_SIZE);
+        for(a = begin; a < finish; a++) counts[(crec_key(&src[a]) >> shift) & (RADIX_SIZE - 1)]++;
+        pthread_barrier_wait(&rs->pass);
+        if(p->id == 0) { // Digit d of slice t goes after all smaller digits, and after digit d of the slices before t
+            rs->skip = 0;
+            for(d = 0, pos = 0; d < RADIX_SIZE; d++) {
+                for(t = 0; t < sort_threads; t++) {
+                    n = rs->counts[t * RADIX_SIZE + d];
+                    rs->counts[t * RADIX_SIZE + d] = pos;
+                    pos += n;
+                    if(n == rs->length) rs->skip = 1;
+                }
+            }
+        }
+        pthread_barrier_wait(&rs->pass);
+        if(rs->skip) continue; // Nothing would move; keep src where it is
+        for(a = begin; a < finish; a++) dst[counts[(crec_key(&src[a]) >> shift) & (RADIX_SIZE - 1)]++] = src[a];
+        pthread_barrier_wait(&rs->pass); // The whole pass is in dst before anyone counts it
+        swap = src; src = dst; dst = swap;
+    }
+    if(p->id == 0) rs->src = src;
+    return NULL;
+}
+
+/* Sort length records by (word1, word2) using tmp as scratch; returns whichever of cr and tmp holds the result */
+CREC *radix_sort(CREC *cr, CREC *tmp, long long length) {
+    long long a;
+    RADIXSORT rs;
+    RADIXPART *parts = (RADIXPART *) malloc(sizeof(RADIXPART) * sort_threads);
+    pthread_t *pt = (pthread_t *) malloc(sizeof(pthread_t) * sort_threads);
+
+    rs.src = cr;
+    rs.dst = tmp;
+    rs.length = length;
+    rs.counts = (long long *) malloc(sizeof(long long) * RADIX_SIZE * sort_threads);
+    pthread_barrier_init(&rs.pass, NULL, sort_threads);
+    for(a = 0; a < sort_threads; a++) {
+        parts[a].rs = &rs;
+        parts[a].id = a;
+        if(a > 0) pthread_create(&pt[a], NULL, radix_sort_part, (void *)&parts[a]);
+    }
+    radix_sort_part((void *)&parts[0]);
+    for(a = 1; a < sort_threads; a++) pthread_join(pt[a], NULL);
+    pthread_barrier_destroy(&rs.pass);
+    free(rs.counts);
+    free(parts);
+    free(pt);
+    return rs.src;
+}
+
+/* Buffers of a spill; the one to count into comes from start_spill */
+int new_spill(SPILL *s) {
+    // A token can add 2 * window_size records past the cutoff of overflow_length - window_size
+    s->cr = (CREC *) malloc(sizeof(CREC) * (overflow_length + window_size));
+    s->tmp = (CREC *) malloc(sizeof(CREC) * (overflow_length + window_size));
+    s->running = 0;
+    if(s->cr == NULL || s->tmp == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    return 0;
+}
+
+void *spill_thread(void *arg) {
+    SPILL *s = (SPILL *)arg;
+    char filename[200];
+    FILE *fout;
+    sprintf(filename,"%s_%04d.bin",file_head,s->fid);
+    fout = fopen(filename,"w");
+    if(fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); s->status = 1; return NULL;}
+    write_chunk(radix_sort(s->cr, s->tmp, s->length), s->length, fout);
+    fclose(fout);
+    s->status = 0;
+    return NULL;
+}
+
+/* Wait until the file of the running spill, if any, is written; returns 1 if it could not be */
+int finish_spill(SPILL *s) {
+    if(!s->running) return 0;
+    pthread_join(s->thread, NULL);
+    s->running = 0;
+    return s->status;
 }
 
-/* Check if two cooccurrence records are for the same two words */
-int compare_crecid(CRECID a, CRECID b) {
-    int c;
-    if( (c = a.word1 - b.word1) != 0) return c;
-    else return a.word2 - b.word2;
+/* Write the length records of *cr to file fid in the background, handing back the buffer of the previous spill in *cr */
+int start_spill(SPILL *s, CREC **cr, long long length, int fid) {
+    CREC *full = *cr;
+    if(finish_spill(s) != 0) return 1;
+    *cr = s->cr;
+    s->cr = full;
+    s->length = length;
+    s->fid = fid;
+    s->running = 1;
+    pthread_create(&s->thread, NULL, spill_thread, (void *)s);
+    return 0;
+}
+
+void free_spill(SPILL *s) {
+    free(s->cr);
+    free(s->tmp);
 }
 
-/* Swap two entries of priority queue */
-void swap_entry(CRECID *pq, int i, int j) {
-    CRECID temp = pq[i];
-    pq[i] = pq[j];
-    pq[j] = temp;
+/* Name of temporary file i of a merge level; level 0 holds the files written while counting */
+void temp_name(char *name, int level, int i) {
+    if(level == 0) sprintf(name,"%s_%04d.bin",file_head,i);
+    else sprintf(name,"%s_%d_%04d.bin",file_head,level,i);
 }
 
-/* Insert entry into priority queue */
-void insert(CRECID *pq, CRECID new, int size) {
-    int j = size - 1, p;
-    pq[j] = new;
-    while( (p=(j-1)/2) >= 0 ) {
-        if(compare_crecid(pq[p],pq[j]) > 0) {swap_entry(pq,p,j); j = p;}
-        else break;
+/* Number of records in a temporary file */
+long long temp_records(FILE *f) {
+    long long n;
+    fseeko(f, 0, SEEK_END);
+    n = ftello(f) / sizeof(CREC);
+    fseeko(f, 0, SEEK_SET);
+    return n;
+}
+
+/* Word1 of record i of a temporary file */
+int temp_word1(FILE *f, long long i) {
+    CREC c;
+    fseeko(f, i * sizeof(CREC), SEEK_SET);
+    if(fread(&c, sizeof(CREC), 1, f) != 1) return 0;
+    return c.word1;
+}
+
+/* First record of a sorted temporary file of n records whose word1 is at least w */
+long long temp_lower_bound(FILE *f, long long n, int w) {
+    long long lo = 0, hi = n, mid;
+    while(lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if(temp_word1(f, mid) < w) lo = mid + 1;
+        else hi = mid;
     }
+    return lo;
 }
 
-/* Delete entry from priority queue */
-void delete(CRECID *pq, int size) {
-    int j, p = 0;
-    pq[p] = pq[size - 1];
-    while( (j = 2*p+1) < size - 1 ) {
-        if(j == size - 2) {
-            if(compare_crecid(pq[p],pq[j]) > 0) swap_entry(pq,p,j);
-            return;
-        }
+/* Read the next records of a run into its buffer; returns 0 once the run is exhausted */
+int run_refill(MERGERUN *r) {
+    long long n = (r->left < merge_buffer) ? r->left : merge_buffer;
+    r->pos = 0;
+    r->count = (n > 0) ? fread(r->buf, sizeof(CREC), n, r->f) : 0;
+    r->left -= r->count;
+    return r->count;
+}
+
+/* Key of the current record of a run, (word1, word2) in one integer; all ones once the run is exhausted */
+unsigned long long run_key(MERGERUN *r) {
+    if(r->pos >= r->count) return ULLONG_MAX;
+    return ((unsigned long long)r->buf[r->pos].word1 << 32) | (unsigned int)r->buf[r->pos].word2;
+}
+
+/* Whether the current record of one run comes before that of another: by key, then by run */
+int node_before(MERGENODE a, MERGENODE b) {
+    return (a.key < b.key) | ((a.key == b.key) & (a.run < b.run));
+}
+
+/* Merge k sorted runs into one stream with a loser tree, accumulating duplicate entries, which are always summed in the order of
+   the runs. Run i plays at leaf k + i and tree[1 .. k-1] holds the loser of the match at each inner node, with its key, so taking
+   a record costs one match per level on the path of its run and each match reads one node. Returns the number of lines written. */
+long long merge_runs(MERGERUN *runs, int k, RECSTREAM *fout) {
+    int i, node;
+    long long counter = 0;
+    MERGENODE w, l, *tree = (MERGENODE *) malloc(sizeof(MERGENODE) * k), *win = (MERGENODE *) malloc(sizeof(MERGENODE) * 2 * k);
+    CREC old, *c;
+
+    for(i = 0; i < k; i++) {
+        win[k + i].key = run_key(&runs[i]);
+        win[k + i].run = i;
+    }
+    for(node = k - 1; node >= 1; node--) {
+        if(node_before(win[2 * node], win[2 * node + 1])) {win[node] = win[2 * node]; tree[node] = win[2 * node + 1];}
+        else {win[node] = win[2 * node + 1]; tree[node] = win[2 * node];}
+    }
+    w = win[1]; // The leaf of the only run when k is 1
+    free(win);
+
+    old.word1 = 0; // Ranks start at 1
+    old.word2 = 0;
+    old.val = 0;
+    while(w.key != ULLONG_MAX) {
+        c = &runs[w.run].buf[runs[w.run].pos];
+        if(c->word1 == old.word1 && c->word2 == old.word2) old.val += c->val;
         else {
-            if(compare_crecid(pq[j], pq[j+1]) < 0) {
-                if(compare_crecid(pq[p],pq[j]) > 0) {swap_entry(pq,p,j); p = j;}
-                else return;
-            }
-            else {
-                if(compare_crecid(pq[p],pq[j+1]) > 0) {swap_entry(pq,p,j+1); p = j + 1;}
-                else return;
-            }
+            if(old.word1 != 0) {putRecord(fout, old.word1, old.word2, old.val); counter++;}
+            old = *c;
+        }
+        if(++runs[w.run].pos >= runs[w.run].count) run_refill(&runs[w.run]);
+        w.key = run_key(&runs[w.run]);
+        for(node = (w.run + k) / 2; node >= 1; node /= 2) { // Replay the matches on the path of w; the winner of each moves up
+            l = tree[node];
+            if(node_before(l, w)) {tree[node] = w; w = l;}
         }
     }
+    if(old.word1 != 0) {putRecord(fout, old.word1, old.word2, old.val); counter++;}
+    free(tree);
+    return counter;
 }
 
-/* Write top node of priority queue to file, accumulating duplicate entries */
-int merge_write(CRECID new, CRECID *old, FILE *fout) {
-    if(new.word1 == old->word1 && new.word2 == old->word2) {
-        old->val += new.val;
-        return 0; // Indicates duplicate entry
+/* Open the records of a merge job in each of its input files and merge them */
+int run_merge_job(MERGEJOB *job) {
+    int i;
+    long long n, first;
+    char filename[200];
+    FILE *f = NULL;
+    RECSTREAM *fout = job->stream;
+    MERGERUN *runs = (MERGERUN *) calloc(job->num, sizeof(MERGERUN));
+
+    job->status = 1;
+    for(i = 0; i < job->num; i++) {
+        temp_name(filename, job->level, job->first + i);
+        runs[i].f = fopen(filename,"rb");
+        runs[i].buf = (CREC *) malloc(sizeof(CREC) * merge_buffer);
+        if(runs[i].f == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
+        if(runs[i].buf == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        n = temp_records(runs[i].f);
+        first = (job->lo > 1) ? temp_lower_bound(runs[i].f, n, job->lo) : 0;
+        runs[i].left = ((job->hi < INT_MAX) ? temp_lower_bound(runs[i].f, n, job->hi) : n) - first;
+        fseeko(runs[i].f, first * sizeof(CREC), SEEK_SET);
+        run_refill(&runs[i]);
+    }
+    if(fout == NULL) {
+        f = fopen(job->out,"wb");
+        if(f == NULL) {fprintf(stderr, "Unable to open file %s.\n",job->out); return 1;}
+        fout = openRecordWriter(f, RECFMT_CREC);
     }
-    fwrite(old, sizeof(CREC), 1, fout);
-    *old = new;
-    return 1; // Actually wrote to file
+    job->lines = merge_runs(runs, job->num, fout);
+    if(f != NULL) {
+        closeRecordWriter(fout);
+        fclose(f);
+    }
+    for(i = 0; i < job->num; i++) {
+        fclose(runs[i].f);
+        free(runs[i].buf);
+    }
+    free(runs);
+    job->status = 0;
+    return 0;
 }
 
-/* Merge [num] sorted files of cooccurrence records */
-int merge_files(int num) {
-    int i, size;
-    long long counter = 0;
-    CRECID *pq, new, old;
+void *merge_thread(void *id) {
+    long long j;
+    for(j = (long long)id; j < num_merge_jobs; j += merge_threads) run_merge_job(&merge_jobs[j]);
+    return NULL;
+}
+
+/* Run the merge jobs on merge_threads threads, each taking every merge_threads-th job; returns 1 if any failed */
+int run_merge_jobs() {
+    long long a;
+    int status = 0;
+    pthread_t *pt = (pthread_t *) malloc(sizeof(pthread_t) * merge_threads);
+    for(a = 0; a < merge_threads; a++) pthread_create(&pt[a], NULL, merge_thread, (void *)a);
+    for(a = 0; a < merge_threads; a++) pthread_join(pt[a], NULL);
+    for(a = 0; a < num_merge_jobs; a++) status |= merge_jobs[a].status;
+    free(pt);
+    return status;
+}
+
+int compare_sample(const void *a, const void *b) {
+    return ((MERGESAMPLE *) a)->word1 - ((MERGESAMPLE *) b)->word1;
+}
+
+/* Split word1 into ranges holding about as many records each, bounds[0 .. ranges], from evenly spaced samples of every file */
+int merge_bounds(int level, int num, int ranges, int *bounds) {
+    int i, s, r, m = 0;
+    long long n, total = 0, sum = 0;
     char filename[200];
-    FILE **fid, *fout;
-    fid = malloc(sizeof(FILE) * num);
-    pq = malloc(sizeof(CRECID) * num);
-    fout = stdout;
-    if(verbose > 1) fprintf(stderr, "Merging cooccurrence files: processed 0 lines.");
-    
-    /* Open all files and add first entry of each to priority queue */
+    FILE *f;
+    MERGESAMPLE *samples = (MERGESAMPLE *) malloc(sizeof(MERGESAMPLE) * num * MERGE_SAMPLES);
     for(i = 0; i < num; i++) {
-        sprintf(filename,"%s_%04d.bin",file_head,i);
-        fid[i] = fopen(filename,"rb");
-        if(fid[i] == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        new.id = i;
-        insert(pq,new,i+1);
+        temp_name(filename, level, i);
+        f = fopen(filename,"rb");
+        if(f == NULL) {fprintf(stderr, "Unable to open file %s.\n",filename); return 1;}
+        n = temp_records(f);
+        for(s = 0; s < MERGE_SAMPLES && n > 0; s++, m++) {
+            samples[m].word1 = temp_word1(f, n * (2 * s + 1) / (2 * MERGE_SAMPLES));
+            samples[m].records = n;
+            total += n;
+        }
+        fclose(f);
     }
-    
-    /* Pop top node, save it in old to see if the next entry is a duplicate */
-    size = num;
-    old = pq[0];
-    i = pq[0].id;
-    delete(pq, size);
-    fread(&new, sizeof(CREC), 1, fid[i]);
-    if(feof(fid[i])) size--;
-    else {
-        new.id = i;
-        insert(pq, new, size);
+    qsort(samples, m, sizeof(MERGESAMPLE), compare_sample);
+    bounds[0] = 0;
+    for(i = 0, r = 1; i < m && r < ranges; i++) {
+        sum += samples[i].records;
+        while(r < ranges && sum * ranges >= total * r) bounds[r++] = samples[i].word1 + 1;
     }
-    
-    /* Repeatedly pop top node and fill priority queue until files have reached EOF */
-    while(size > 0) {
-        counter += merge_write(pq[0], &old, fout); // Only count the lines written to file, not duplicates
-        if((counter%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[39G%lld lines.",counter);
-        i = pq[0].id;
-        delete(pq, size);
-        fread(&new, sizeof(CREC), 1, fid[i]);
-        if(feof(fid[i])) size--;
-        else {
-            new.id = i;
-            insert(pq, new, size);
+    while(r <= ranges) bounds[r++] = INT_MAX;
+    free(samples);
+    return 0;
+}
+
+/* Remove files 0 .. num - 1 of a merge level */
+void remove_level(int level, int num) {
+    int i;
+    char filename[200];
+    for(i = 0; i < num; i++) {
+        temp_name(filename, level, i);
+        remove(filename);
+    }
+}
+
+/* Merge [num] sorted files of cooccurrence records. While there are more than MERGE_FAN_IN, groups of them are merged into the
+   files of a next level. The last merge writes the output, either directly or, with several threads, one range of word1 per
+   thread into a file of its own, copied to the output in order. Neither the grouping nor the ranges depend on the number of
+   threads, so neither does the output. */
+int merge_files(int num) {
+    int j, level = 0, next, *bounds;
+    long long counter = 0;
+    FILE *fin;
+    RECSTREAM *fout, *part;
+    CREC c;
+
+    merge_buffer = (long long) (memory_limit * 1073741824 / 2) / ((long long) sizeof(CREC) * MERGE_FAN_IN * num_threads);
+    if(merge_buffer > MERGE_BUFFER_RECORDS) merge_buffer = MERGE_BUFFER_RECORDS;
+    if(merge_buffer < 1024) merge_buffer = 1024;
+    if(verbose > 1) fprintf(stderr, "Merging cooccurrence files: ");
+
+    while(num > MERGE_FAN_IN) {
+        next = (num + MERGE_FAN_IN - 1) / MERGE_FAN_IN;
+        num_merge_jobs = next;
+        merge_jobs = (MERGEJOB *) calloc(num_merge_jobs, sizeof(MERGEJOB));
+        for(j = 0; j < next; j++) {
+            merge_jobs[j].level = level;
+            merge_jobs[j].first = j * MERGE_FAN_IN;
+            merge_jobs[j].num = (num - j * MERGE_FAN_IN < MERGE_FAN_IN) ? num - j * MERGE_FAN_IN : MERGE_FAN_IN;
+            merge_jobs[j].lo = 0;
+            merge_jobs[j].hi = INT_MAX;
+            temp_name(merge_jobs[j].out, level + 1, j);
         }
+        merge_threads = (num_threads < MERGE_MAX_OPEN / MERGE_FAN_IN) ? num_threads : MERGE_MAX_OPEN / MERGE_FAN_IN;
+        if(run_merge_jobs() != 0) return 1;
+        free(merge_jobs);
+        remove_level(level, num);
+        if(verbose > 1) fprintf(stderr, "%d files, then ", num);
+        level++;
+        num = next;
     }
-    fwrite(&old, sizeof(CREC), 1, fout);
-    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",++counter);
-    for(i=0;i<num;i++) {
-        sprintf(filename,"%s_%04d.bin",file_head,i);
-        remove(filename);
+
+    fout = openRecordWriter(stdout, output_format);
+    merge_threads = (num_threads < MERGE_MAX_OPEN / num) ? num_threads : MERGE_MAX_OPEN / num;
+    if(merge_threads < 1) merge_threads = 1;
+    num_merge_jobs = merge_threads;
+    merge_jobs = (MERGEJOB *) calloc(num_merge_jobs, sizeof(MERGEJOB));
+    bounds = (int *) malloc(sizeof(int) * (num_merge_jobs + 1));
+    if(num_merge_jobs > 1) {
+        if(merge_bounds(level, num, num_merge_jobs, bounds) != 0) return 1;
+    }
+    else {
+        bounds[0] = 0;
+        bounds[1] = INT_MAX;
     }
+    for(j = 0; j < num_merge_jobs; j++) {
+        merge_jobs[j].level = level;
+        merge_jobs[j].first = 0;
+        merge_jobs[j].num = num;
+        merge_jobs[j].lo = bounds[j];
+        merge_jobs[j].hi = bounds[j + 1];
+        if(num_merge_jobs == 1) merge_jobs[j].stream = fout;
+        else temp_name(merge_jobs[j].out, level + 1, j);
+    }
+    if(run_merge_jobs() != 0) return 1;
+    for(j = 0; j < num_merge_jobs; j++) {
+        counter += merge_jobs[j].lines;
+        if(num_merge_jobs == 1) continue;
+        fin = fopen(merge_jobs[j].out,"rb");
+        if(fin == NULL) {fprintf(stderr, "Unable to open file %s.\n",merge_jobs[j].out); return 1;}
+        part = openRecordReader(fin);
+        while(getRecord(part, &c.word1, &c.word2, &c.val)) putRecord(fout, c.word1, c.word2, c.val);
+        closeRecordReader(part);
+        fclose(fin);
+        remove(merge_jobs[j].out);
+    }
+    closeRecordWriter(fout);
+    remove_level(level, num);
+    if(verbose > 1) fprintf(stderr, "%d files, on %d threads.\n", num, merge_threads);
+    fprintf(stderr,"\033[0GMerging cooccurrence files: processed %lld lines.\n",counter);
+    free(merge_jobs);
+    free(bounds);
     fprintf(stderr,"\n");
     return 0;
 }
 
+/* Tokenize the span of a thread: ranks of in-vocabulary words, 0 for each newline; other words are skipped */
+void tokenize(COUNTTHREAD *t) {
+    int flag;
+    char word[MAX_STRING_LENGTH + 1];
+    int w;
+    TOKENREADER *tokens = openTokenText(t->text, t->length, TOKEN_GETWORD, MAX_STRING_LENGTH);
+    t->num_ids = t->tokens = 0;
+    while((flag = readToken(tokens, word)) != TOKEN_END) {
+        if(flag == TOKEN_NEWLINE) {t->ids[t->num_ids++] = 0; continue;}
+        t->tokens++;
+        if((w = vocabRank(vocab, word)) != 0) t->ids[t->num_ids++] = w;
+    }
+    closeTokenReader(tokens);
+}
+
+/* Room for one more element in a growable array of *max elements, n of them in use */
+void *grow(void *p, long long n, long long *max, size_t size) {
+    if(n < *max) return p;
+    *max = (*max < 1024) ? 1024 : 2 * *max;
+    p = realloc(p, size * *max);
+    if(p == NULL) {fprintf(stderr, "Couldn't allocate memory!"); exit(1);}
+    return p;
+}
+
+/* Keep an addition of 1/d to bigram_table[offset] for the thread owning its row */
+void add_cell(COUNTTHREAD *t, int owner, long long offset, long long d) {
+    t->cells[owner] = (unsigned long long *) grow(t->cells[owner], t->num_cells[owner], &t->max_cells[owner], sizeof(unsigned long long));
+    t->cells[owner][t->num_cells[owner]++] = ((unsigned long long)offset << dist_bits) | (unsigned long long)d;
+}
+
+void add_record(COUNTTHREAD *t, long long w1, long long w2, long long d) {
+    t->cr = (CREC *) grow(t->cr, t->num_cr, &t->max_cr, sizeof(CREC));
+    t->cr[t->num_cr].word1 = w1;
+    t->cr[t->num_cr].word2 = w2;
+    t->cr[t->num_cr].val = inv_dist[d];
+    t->num_cr++;
+}
+
+/* The in-vocabulary words of the line going on at the start of span s (num_threads for the end of the batch), at most window_size
+   of them, oldest first: from the spans before it, then from the end of the batch before. Returns how many there are. */
+long long line_tail(int s, long long *tail) {
+    long long a, n = 0, w;
+    int line_start = 0;
+    for(s--; s >= 0 && n < window_size && !line_start; s--) {
+        for(a = count_threads[s].num_ids - 1; a >= 0 && n < window_size; a--) {
+            if((w = count_threads[s].ids[a]) == 0) {line_start = 1; break;}
+            tail[n++] = w;
+        }
+    }
+    for(a = num_line_carry - 1; a >= 0 && n < window_size && !line_start; a--) tail[n++] = line_carry[a];
+    for(a = 0; a < n / 2; a++) {w = tail[a]; tail[a] = tail[n - 1 - a]; tail[n - 1 - a] = w;}
+    return n;
+}
+
+/* Run the window over the tokens of a span, keeping its additions to bigram_table and its overflow records */
+void count_span(COUNTTHREAD *t) {
+    long long a, k, j, w1, w2, limit, num_cr;
+    t->num_cr = t->num_ends = 0;
+    for(a = 0; a < num_threads; a++) t->num_cells[a] = 0;
+    j = line_tail(t->id, t->history); // At most window_size words, so they sit at their own positions of the circular window
+    for(a = 0; a < t->num_ids; a++) {
+        if((w2 = t->ids[a]) == 0) {j = 0; continue;} // Newline, reset line index (j)
+        limit = max_product/w2;
+        num_cr = t->num_cr;
+        for(k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) {
+            w1 = t->history[k % window_size];
+            if ( w1 < limit ) {
+                add_cell(t, row_owner[w1], lookup[w1-1] + w2 - 2, j - k);
+                if(symmetric > 0) add_cell(t, row_owner[w2], lookup[w2-1] + w1 - 2, j - k);
+            }
+            else {
+                add_record(t, w1, w2, j - k);
+                if(symmetric > 0) add_record(t, w2, w1, j - k);
+            }
+        }
+        if(t->num_cr > num_cr) {
+            t->ends = (long long *) grow(t->ends, t->num_ends, &t->max_ends, sizeof(long long));
+            t->ends[t->num_ends++] = t->num_cr;
+        }
+        t->history[j % window_size] = w2;
+        j++;
+    }
+}
+
+/* Start the pieces of one more file the batch adds to, empty for every span */
+void new_piece_file() {
+    long long s;
+    if(num_full + 1 > max_full) {
+        max_full = 2 * max_full + 1;
+        pieces = (OVERFLOWPIECE *) realloc(pieces, sizeof(OVERFLOWPIECE) * max_full * num_threads);
+        full_length = (long long *) realloc(full_length, sizeof(long long) * max_full);
+        if(pieces == NULL || full_length == NULL) {fprintf(stderr, "Couldn't allocate memory!"); exit(1);}
+    }
+    for(s = 0; s < num_threads; s++) pieces[num_full * num_threads + s].from = pieces[num_full * num_threads + s].to = 0;
+}
+
+/* Cut the overflow records of the batch, span after span, into the files they go to: a file ends after the first token that
+   leaves it with at least overflow_length - window_size records, as in the single-threaded loop */
+void split_overflow() {
+    long long s, from, lo, hi, mid, need;
+    COUNTTHREAD *t;
+    OVERFLOWPIECE *p;
+    num_full = 0;
+    new_piece_file();
+    for(s = 0; s < num_threads; s++) {
+        t = &count_threads[s];
+        for(from = 0, lo = 0; ; ) {
+            need = from + overflow_length - window_size - overflow_ind;
+            for(hi = t->num_ends; lo < hi; ) { // First token of the span ending at or past need
+                mid = lo + (hi - lo) / 2;
+                if(t->ends[mid] < need) lo = mid + 1;
+                else hi = mid;
+            }
+            p = &pieces[num_full * num_threads + s];
+            p->from = from;
+            p->dst = overflow_ind;
+            p->to = (lo < t->num_ends) ? t->ends[lo] : t->num_cr;
+            overflow_ind += p->to - from;
+            if(lo == t->num_ends) break;
+            full_length[num_full++] = overflow_ind;
+            overflow_ind = 0;
+            new_piece_file();
+            from = t->ends[lo++];
+        }
+    }
+}
+
+/* Count one batch: tokenize and count the span of this thread, then add to the rows of bigram_table it owns, from every span in
+   order, and copy its overflow records into the files they go to, spilling each file the batch completes */
+void *count_thread(void *arg) {
+    COUNTTHREAD *t = (COUNTTHREAD *)arg;
+    long long s, a, f, n;
+    unsigned long long *cells, mask = (1ULL << dist_bits) - 1;
+    OVERFLOWPIECE *p;
+
+    tokenize(t);
+    pthread_barrier_wait(&count_phase); // The spans before this one give the start of its window
+    count_span(t);
+    pthread_barrier_wait(&count_phase);
+    if(t->id == 0) split_overflow();
+    pthread_barrier_wait(&count_phase);
+    for(f = 0; f <= num_full; f++) {
+        p = &pieces[f * num_threads + t->id];
+        if(p->to > p->from) memcpy(overflow_cr + p->dst, t->cr + p->from, sizeof(CREC) * (p->to - p->from));
+        if(f == num_full) break; // The file left open, filled on by the next batches
+        pthread_barrier_wait(&count_phase);
+        if(t->id == 0 && start_spill(&overflow_spill, &overflow_cr, full_length[f], overflow_fid++) != 0) exit(1);
+        pthread_barrier_wait(&count_phase);
+    }
+    for(s = 0; s < num_threads; s++) {
+        cells = count_threads[s].cells[t->id];
+        n = count_threads[s].num_cells[t->id];
+        for(a = 0; a < n; a++) bigram_table[cells[a] >> dist_bits] += inv_dist[cells[a] & mask];
+    }
+    return NULL;
+}
+
+int is_space(char c) {
+    return (c == ' ') || (c == '\t') || (c == '\n');
+}
+
+/* Count the cooccurrences of stdin on num_threads threads, one batch of text at a time: the batch ends at whitespace and is split
+   into one span per thread, at the end of a line when one ends near the cut, otherwise at whitespace. Returns the number of the
+   last overflow file and the numbers of tokens and bytes read. */
+int count_parallel(long long *counter, long long *bytes, int *fidcounter) {
+    long long a, n, carry = 0, cut, start, end, next, buf_size = (long long)BATCH_BYTES * num_threads;
+    int at_eof = 0;
+    char *buf = (char *) malloc(buf_size), *nl;
+    pthread_t *pt = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
+    COUNTTHREAD *t;
+
+    count_threads = (COUNTTHREAD *) calloc(num_threads, sizeof(COUNTTHREAD));
+    row_owner = (int *) malloc(sizeof(int) * (vocab_size + 1));
+    inv_dist = (real *) malloc(sizeof(real) * (window_size + 1));
+    line_carry = (long long *) malloc(sizeof(long long) * window_size);
+    overflow_cr = (CREC *) malloc(sizeof(CREC) * (overflow_length + window_size));
+    if(buf == NULL || row_owner == NULL || inv_dist == NULL || line_carry == NULL || overflow_cr == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    if(new_spill(&overflow_spill) != 0) return 1;
+    for(a = 0; a <= vocab_size; a++) row_owner[a] = a % num_threads;
+    for(dist_bits = 1; (1LL << dist_bits) <= window_size; dist_bits++);
+    for(a = 1; a <= window_size; a++) inv_dist[a] = 1.0/((real)a);
+    for(a = 0; a < num_threads; a++) {
+        t = &count_threads[a];
+        t->id = a;
+        t->history = (long long *) malloc(sizeof(long long) * window_size);
+        t->cells = (unsigned long long **) calloc(num_threads, sizeof(unsigned long long *));
+        t->num_cells = (long long *) calloc(num_threads, sizeof(long long));
+        t->max_cells = (long long *) calloc(num_threads, sizeof(long long));
+        if(t->history == NULL || t->cells == NULL || t->num_cells == NULL || t->max_cells == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+    }
+    pthread_barrier_init(&count_phase, NULL, num_threads);
+    num_line_carry = 0;
+    overflow_ind = 0;
+    overflow_fid = 1;
+
+    *counter = *bytes = 0;
+    while(!at_eof) {
+        n = carry + fread(buf + carry, 1, buf_size - carry, stdin);
+        *bytes += n - carry;
+        at_eof = (n < buf_size);
+        cut = n;
+        if(!at_eof) { // The word cut by the end of the buffer is left for the next batch
+            while(cut > 0 && !is_space(buf[cut - 1])) cut--;
+            if(cut == 0) { // One word longer than the buffer
+                buf_size *= 2;
+                buf = (char *) realloc(buf, buf_size);
+                carry = n;
+                continue;
+            }
+        }
+        for(a = 0, start = 0; a < num_threads; a++, start = end) {
+            t = &count_threads[a];
+            end = (a == num_threads - 1) ? cut : cut * (a + 1) / num_threads;
+            next = (a >= num_threads - 2) ? cut : cut * (a + 2) / num_threads;
+            if(end < start) end = start;
+            if(end < cut && end > 0 && buf[end - 1] != '\n') {
+                nl = (next > end) ? (char *) memchr(buf + end, '\n', next - end) : NULL;
+                if(nl != NULL) end = nl - buf + 1;
+                else while(end < cut && !is_space(buf[end - 1])) end++;
+            }
+            t->text = buf + start;
+            t->length = end - start;
+            if(t->length + 1 > t->max_ids) { // At most one id per character
+                t->max_ids = t->length + 1;
+                free(t->ids);
+                t->ids = (int *) malloc(sizeof(int) * t->max_ids);
+                if(t->ids == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+            }
+        }
+        for(a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, count_thread, (void *)&count_threads[a]);
+        for(a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+        for(a = 0; a < num_threads; a++) *counter += count_threads[a].tokens;
+        num_line_carry = line_tail(num_threads, count_threads[0].history); // The window of the next batch starts from there
+        memcpy(line_carry, count_threads[0].history, sizeof(long long) * num_line_carry);
+        if(verbose > 1) fprintf(stderr,"\033[19G%lld",*counter);
+        carry = n - cut;
+        memmove(buf, buf + cut, carry);
+    }
+
+    /* Write out the last overflow file (it may not be full) */
+    if(start_spill(&overflow_spill, &overflow_cr, overflow_ind, overflow_fid) != 0 || finish_spill(&overflow_spill) != 0) return 1;
+    *fidcounter = overflow_fid;
+    free_spill(&overflow_spill);
+    for(a = 0; a < num_threads; a++) {
+        t = &count_threads[a];
+        for(n = 0; n < num_threads; n++) free(t->cells[n]);
+        free(t->cells);
+        free(t->num_cells);
+        free(t->max_cells);
+        free(t->history);
+        free(t->cr);
+        free(t->ends);
+        free(t->ids);
+    }
+    pthread_barrier_destroy(&count_phase);
+    free(count_threads);
+    free(row_owner);
+    free(inv_dist);
+    free(line_carry);
+    free(overflow_cr);
+    free(pieces);
+    free(full_length);
+    free(pt);
+    free(buf);
+    return 0;
+}
+
 /* Collect word-word cooccurrence counts from input stream */
 int get_cooccurrence() {
     int flag, x, y, fidcounter = 1;
-    long long a, j = 0, k, id, counter = 0, ind = 0, vocab_size, w1, w2, *lookup, *history;
-    char format[20], filename[200], str[MAX_STRING_LENGTH + 1];
-    FILE *fid, *foverflow;
-    real *bigram_table, r;
-    HASHREC *htmp, **vocab_hash = inithashtable();
-    CREC *cr = malloc(sizeof(CREC) * (overflow_length + 1));
+    long long a, j = 0, k, counter = 0, ind = 0, w1, w2, *history, bytes;
+    char filename[200], str[MAX_STRING_LENGTH + 1];
+    FILE *fid;
+    real r;
+    CREC *cr = NULL;
+    SPILL spill;
+    TOKENREADER *tokens;
+    struct timespec start, end;
     history = malloc(sizeof(long long) * window_size);
     
     fprintf(stderr, "COUNTING COOCCURRENCES\n");
@@ -296,14 +868,12 @@ int get_cooccurrence() {
     }
     if(verbose > 1) fprintf(stderr, "max product: %lld\n", max_product);
     if(verbose > 1) fprintf(stderr, "overflow length: %lld\n", overflow_length);
-    sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH); // Format to read from vocab file, which has (irrelevant) frequency data
     if(verbose > 1) fprintf(stderr, "Reading vocab from file \"%s\"...", vocab_file);
-    fid = fopen(vocab_file,"r");
-    if(fid == NULL) {fprintf(stderr,"Unable to open vocab file %s.\n",vocab_file); return 1;}
-    while(fscanf(fid, format, str, &id) != EOF) hashinsert(vocab_hash, str, ++j); // Here id is not used: inserting vocab words into hash table with their frequency rank, j
-    fclose(fid);
-    vocab_size = j;
-    j = 0;
+    vocab = loadVocab(vocab_file); // The frequency data of the file is not used, only the ranks
+    if(vocab == NULL) {fprintf(stderr,"Unable to open vocab file %s.\n",vocab_file); return 1;}
+    vocab_size = vocab->size;
+    for(a = 0; a < vocab_size; a++) if(vocabRank(vocab, vocab->words[a]) != a + 1) fprintf(stderr, "Error, duplicate entry located: %s.\n", vocab->words[a]);
+    for(key_bits = 1; (1LL << key_bits) <= vocab_size; key_bits++);
     if(verbose > 1) fprintf(stderr, "loaded %lld words.\nBuilding lookup table...", vocab_size);
     
     /* Build auxiliary lookup table used to index into bigram_table */
@@ -326,58 +896,62 @@ int get_cooccurrence() {
         return 1;
     }
     
-    fid = stdin;
-    sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
-    foverflow = fopen(filename,"w");
     if(verbose > 1) fprintf(stderr,"Processing token: 0");
-    
-    /* For each token in input stream, calculate a weighted cooccurrence sum within window_size */
-    while (1) {
-        if(ind >= overflow_length - window_size) { // If overflow buffer is (almost) full, sort it and write it to temporary file
-            qsort(cr, ind, sizeof(CREC), compare_crec);
-            write_chunk(cr,ind,foverflow);
-            fclose(foverflow);
-            fidcounter++;
-            sprintf(filename,"%s_%04d.bin",file_head,fidcounter);
-            foverflow = fopen(filename,"w");
-            ind = 0;
-        }
-        flag = get_word(str, fid);
-        if(feof(fid)) break;
-        if(flag == 1) {j = 0; continue;} // Newline, reset line index (j)
-        counter++;
-        if((counter%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[19G%lld",counter);
-        htmp = hashsearch(vocab_hash, str);
-        if (htmp == NULL) continue; // Skip out-of-vocabulary words
-        w2 = htmp->id; // Target word (frequency rank)
-        for(k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) { // Iterate over all words to the left of target word, but not past beginning of line
-            w1 = history[k % window_size]; // Context word (frequency rank)
-            if ( w1 < max_product/w2 ) { // Product is small enough to store in a full array
-                bigram_table[lookup[w1-1] + w2 - 2] += 1.0/((real)(j-k)); // Weight by inverse of distance between words
-                if(symmetric > 0) bigram_table[lookup[w2-1] + w1 - 2] += 1.0/((real)(j-k)); // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if(num_threads > 1) {
+        if(count_parallel(&counter, &bytes, &fidcounter) != 0) return 1;
+    }
+    else {
+        cr = malloc(sizeof(CREC) * (overflow_length + window_size));
+        if(cr == NULL) {fprintf(stderr, "Couldn't allocate memory!"); return 1;}
+        if(new_spill(&spill) != 0) return 1;
+        tokens = openTokenReader(stdin, TOKEN_GETWORD, MAX_STRING_LENGTH);
+        
+        /* For each token in input stream, calculate a weighted cooccurrence sum within window_size */
+        while (1) {
+            if(ind >= overflow_length - window_size) { // If overflow buffer is (almost) full, sort it and write it to temporary file while counting into the other one
+                if(start_spill(&spill, &cr, ind, fidcounter) != 0) return 1;
+                fidcounter++;
+                ind = 0;
             }
-            else { // Product is too big, data is likely to be sparse. Store these entries in a temporary buffer to be sorted, merged (accumulated), and written to file when it gets full.
-                cr[ind].word1 = w1;
-                cr[ind].word2 = w2;
-                cr[ind].val = 1.0/((real)(j-k));
-                ind++; // Keep track of how full temporary buffer is
-                if(symmetric > 0) { // Symmetric context
-                    cr[ind].word1 = w2;
-                    cr[ind].word2 = w1;
+            flag = readToken(tokens, str);
+            if(flag == TOKEN_END) break;
+            if(flag == TOKEN_NEWLINE) {j = 0; continue;} // Newline, reset line index (j)
+            counter++;
+            if((counter%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[19G%lld",counter);
+            if ((w2 = vocabRank(vocab, str)) == 0) continue; // Skip out-of-vocabulary words; w2 is the target word (frequency rank)
+            for(k = j - 1; k >= ( (j > window_size) ? j - window_size : 0 ); k--) { // Iterate over all words to the left of target word, but not past beginning of line
+                w1 = history[k % window_size]; // Context word (frequency rank)
+                if ( w1 < max_product/w2 ) { // Product is small enough to store in a full array
+                    bigram_table[lookup[w1-1] + w2 - 2] += 1.0/((real)(j-k)); // Weight by inverse of distance between words
+                    if(symmetric > 0) bigram_table[lookup[w2-1] + w1 - 2] += 1.0/((real)(j-k)); // If symmetric context is used, exchange roles of w2 and w1 (ie look at right context too)
+                }
+                else { // Product is too big, data is likely to be sparse. Store these entries in a temporary buffer to be sorted, merged (accumulated), and written to file when it gets full.
+                    cr[ind].word1 = w1;
+                    cr[ind].word2 = w2;
                     cr[ind].val = 1.0/((real)(j-k));
-                    ind++;
+                    ind++; // Keep track of how full temporary buffer is
+                    if(symmetric > 0) { // Symmetric context
+                        cr[ind].word1 = w2;
+                        cr[ind].word2 = w1;
+                        cr[ind].val = 1.0/((real)(j-k));
+                        ind++;
+                    }
                 }
             }
+            history[j % window_size] = w2; // Target word is stored in circular buffer to become context word in the future
+            j++;
         }
-        history[j % window_size] = w2; // Target word is stored in circular buffer to become context word in the future
-        j++;
+        
+        /* Write out temp buffer for the final time (it may not be full) */
+        if(start_spill(&spill, &cr, ind, fidcounter) != 0 || finish_spill(&spill) != 0) return 1;
+        free_spill(&spill);
+        bytes = tokens->bytes;
+        closeTokenReader(tokens);
     }
-    
-    /* Write out temp buffer for the final time (it may not be full) */
-    if(verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens.\n",counter);
-    qsort(cr, ind, sizeof(CREC), compare_crec);
-    write_chunk(cr,ind,foverflow);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(verbose > 1) fprintf(stderr,"\033[0GProcessed %lld tokens (%.1f MB at %.2f GB/s).\n", counter, bytes / 1e6,
+        bytes / 1e9 / (end.tv_sec - start.tv_sec + 1e-9 * (end.tv_nsec - start.tv_nsec) + 1e-9));
     sprintf(filename,"%s_0000.bin",file_head);
     
     /* Write out full bigram_table, skipping zeros */
@@ -397,11 +971,11 @@ int get_cooccurrence() {
     
     if(verbose > 1) fprintf(stderr,"%d files in total.\n",fidcounter + 1);
     fclose(fid);
-    fclose(foverflow);
     free(cr);
     free(lookup);
     free(bigram_table);
-    free(vocab_hash);
+    freeVocab(vocab);
+    free(history);
     return merge_files(fidcounter + 1); // Merge the sorted temporary files
 }
 
@@ -443,6 +1017,13 @@ int main(int argc, char **argv) {
         printf("\t\tLimit the size of dense cooccurrence array by specifying the max product <int> of the frequency counts of the two cooccurring words.\n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
         printf("\t-overflow-length <int>\n");
         printf("\t\tLimit to length <int> the sparse overflow array, which buffers cooccurrence data that does not fit in the dense array, before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'. Typically only needs adjustment for use with very large corpora.\n");
+        printf("\t\tThree arrays of this length are allocated (the one being filled, the one being sorted and written, the scratch space of the sort), so the default\n\t\tfrom '-memory' is a third of what one array would get, and the corpus is written to about three times as many temporary files.\n");
+        printf("\t-format <name>\n");
+        printf("\t\tFormat of the output records: crec (default; 16 bytes), compact (12 bytes, count as float) or block (compact, block-compressed ids)\n");
+        printf("\t-threads <int>\n");
+        printf("\t\tNumber of threads counting cooccurrences and merging the temporary files; default 1. The output does not depend on it\n");
+        printf("\t-sort-threads <int>\n");
+        printf("\t\tNumber of threads sorting each full overflow buffer, which is written to disk while counting continues in a second buffer; default 4\n");
         printf("\t-overflow-file <file>\n");
         printf("\t\tFilename, excluding extension, for temporary files; default overflow\n");
 
@@ -458,6 +1039,14 @@ int main(int argc, char **argv) {
     else strcpy(vocab_file, (char *)"vocab.txt");
     if ((i = find_arg((char *)"-overflow-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
     else strcpy(file_head, (char *)"overflow");
+    if ((i = find_arg((char *)"-format", argc, argv)) > 0 && (output_format = formatFromName(argv[i + 1])) < 0) {
+        fprintf(stderr, "Unknown format %s.\n", argv[i + 1]);
+        return 1;
+    }
+    if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
+    if (num_threads < 1) num_threads = 1;
+    if ((i = find_arg((char *)"-sort-threads", argc, argv)) > 0) sort_threads = atoi(argv[i + 1]);
+    if (sort_threads < 1) sort_threads = 1;
     if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
     
     /* The memory_limit determines a limit on the number of elements in bigram_table and the overflow buffer */
@@ -465,7 +1054,8 @@ int main(int argc, char **argv) {
     rlimit = 0.85 * (real)memory_limit * 1073741824/(sizeof(CREC));
     while(fabs(rlimit - n * (log(n) + 0.1544313298)) > 1e-3) n = rlimit / (log(n) + 0.1544313298);
     max_product = (long long) n;
-    overflow_length = (long long) rlimit/6; // 0.85 + 1/6 ~= 1
+    overflow_length = (long long) rlimit/18; // 0.85 + 3/18 ~= 1: the buffer being filled, the one being written and the scratch space of its sort;
+                                             // each is a third of the single buffer of rlimit/6, so there are three times as many temporary files
     
     /* Override estimates by specifying limits explicitly on the command line */
     if ((i = find_arg((char *)"-max-product", argc, argv)) > 0) max_product = atoll(argv[i + 1]);
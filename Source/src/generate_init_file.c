@@ -12,6 +12,8 @@
 
 int verbose = 2; // 0, 1, or 2
 int vector_size = 50; // Word vector size
+int use_seed = 0; // 0: rand(), as before; 1: the counter-based generator of glove_imbue -random-init 2, with seed
+unsigned int seed = 1;
 real *W;
 long long vocab_size;
 char *vocab_file;
@@ -41,9 +43,10 @@ void initialize_parameters() {
 	// Initialization file
 	finit = fopen(init_file,"wb");
 	// Random-init
-	for (b = 0; b < vector_size; b++) for (a = 0; a < 2 * vocab_size; a++) W[a * vector_size + b] = (rand() / (real)RAND_MAX - 0.5) / vector_size;
+	if(use_seed) for (a = 0; a < 2 * vocab_size; a++) initRandomRow(W + a * vector_size, vector_size, a, seed);
+	else for (b = 0; b < vector_size; b++) for (a = 0; a < 2 * vocab_size; a++) W[a * vector_size + b] = (rand() / (real)RAND_MAX - 0.5) / vector_size;
 	// Write to file
-	fwrite(W, sizeof(real), 2 * (long long)vocab_size * vector_size, finit);
+	writeReals(W, 2 * (long long)vocab_size * vector_size, finit);
 	fclose(finit);
 }
 
@@ -74,6 +77,8 @@ int main(int argc, char **argv) {
         printf("\t\tDimension of word vector representations (excluding bias term); default 50\n");
         printf("\t-vocab-file <file>\n");
         printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count'); default vocab.txt\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tGenerate the values with the counter-based generator and this seed, as 'glove_imbue -random-init 2 -seed <int>' does; default: rand()\n");
         printf("\nExample usage:\n");
         printf("./generate_init_file -vocab-file vocab.txt -verbose 2 -vector-size 100\n\n");
         return 0;
@@ -84,6 +89,10 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-vector-size", argc, argv)) > 0) vector_size = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
     else strcpy(vocab_file, (char *)"vocab.txt");
+    if ((i = find_arg((char *)"-seed", argc, argv)) > 0) {
+        seed = atoi(argv[i + 1]);
+        use_seed = 1;
+    }
     
     // Additional input arguments defined here: (declare such variables globally with a default definition)
     //
@@ -22,24 +22,37 @@
 //    http://nlp.stanford.edu/projects/glove/
 
 
+#define _GNU_SOURCE // CPU affinity and MAP_HUGETLB
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <tgmath.h> // Type-generic math, so single-precision builds call the float variants
 #include <pthread.h>
 
 // Additional headers
 #include <time.h>
 #include <ctype.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sched.h>
 #include "helperfuncs.h"
+#include "recordfile.h"
+#include "embfile.h"
+#include "vocabtable.h"
 
 #define _FILE_OFFSET_BITS 64
 #define MAX_STRING_LENGTH 1000
+#define HUGE_PAGE_SIZE (2 << 20)
+#define MPOL_INTERLEAVE 3 // From <numaif.h>, which needs libnuma
+#define MAX_NUMA_NODES 1024
 
 typedef struct cooccur_rec {
     int word1;
     int word2;
-    real val;
+    double val; // Stored as double on disk regardless of the precision of real
 } CREC;
 
 int verbose = 2; // 0, 1, or 2
@@ -49,17 +62,131 @@ int num_iter = 25; // Number of full passes through cooccurrence matrix
 int vector_size = 50; // Word vector size
 int save_gradsq = 0; // By default don't save squared gradient values
 int use_binary = 1; // 0: save as text files; 1: save as binary; 2: both. For binary, save both word and context word vectors.
+int save_emb = 0; // Also write the vectors of the chosen model as an indexed, mappable .emb file
+#ifdef SINGLE_PRECISION
+int emb_dtype = EMB_DTYPE_FLOAT32; // Type of the values in the .emb file
+#else
+int emb_dtype = EMB_DTYPE_FLOAT64;
+#endif
+int shortest_text = 0; // Text output: 0: six decimals, as printf("%lf"); 1: the shortest text that reads back to the same value
 int model = 2; // For text file output only. 0: concatenate word and context vectors (and biases) i.e. save everything; 1: Just save word vectors (no bias); 2: Save (word + context word) vectors (no biases)
 real eta = 0.05; // Initial learning rate
 real alpha = 0.75, x_max = 100.0; // Weighting function parameters, not extremely sensitive to corpus, though may need adjustment for very small or very large corpora
-real *W, *gradsq, *cost;
-long long num_lines, *lines_per_thread, vocab_size;
+real *W, *gradsq;
+
+// Per-thread counters for one epoch, one cache line per thread and model; records and times are counted in the entry of the first model.
+// Costs are accumulated in double even in single-precision builds
+typedef struct thread_stats {
+    double cost; // Squared-error (GloVe) part of the cost
+    double cost_forced; // Forced-term part of the cost
+    long long records;
+    long long forced_hits; // Number of forced words seen across all records
+    double wall_seconds, cpu_seconds, io_seconds;
+} __attribute__((aligned(64))) THREADSTATS;
+THREADSTATS *thread_stats; // Model m of thread t at [t * num_models + m]
+
+// A record with log X and f(X) computed, in the precision of real
+typedef struct weighted_rec {
+    int word1;
+    int word2;
+    real logx;
+    real weight;
+} WREC;
+
+// Per-thread scratch space of the update
+typedef struct workspace {
+    real *forced_state1, *forced_state2; // Pre-update state of the forced components, used to patch them after the dense update
+    real *frozen_rows; // Throwaway copies of frozen rows and their squared gradients, (vector_size + 1) reals each
+    WREC *decoded; // Records with log X and f(X), shared by the models
+    long long decoded_size;
+    double *forcing_weights; // Total f(X) of each word and context id seen by this thread, while they are being counted; NULL otherwise
+} WORKSPACE;
+char *metrics_file = NULL; // JSON lines with per-iteration and per-thread training metrics; NULL for none
+FILE *fmetrics = NULL;
+long long num_lines, vocab_size;
+VOCABTABLE *vocab; // The words of vocab_file, loaded once
 char *vocab_file, *input_file, *save_W_file, *save_gradsq_file;
+char *simd_isa = "auto"; // Kernel used for the per-record update: auto, avx512, avx2 or generic
+long long chunk_size = 16384; // Records per unit of work; each epoch is split into many chunks that idle threads steal from each other
+int in_memory = 0; // 0: stream the cooccurrence file from disk every iteration; 1: memory-map it; 2: load it into a shared buffer (falls back to 1 if it does not fit)
+int record_format = RECFMT_CREC; // Format of the input file, from its header: CREC, precomputed TREC, compact CRECF or blocks of CRECF
+long long record_size = sizeof(CREC), record_offset = 0; // Size of one record and of the header before the first
+long long num_blocks = 0, *block_offsets = NULL, *block_starts = NULL; // RECFMT_BLOCK: file offset and first record of each block (plus one past the end); blocks are the chunks
+int max_block_records = 0, max_block_bytes = 0;
+void *rec_mapping = NULL; // Whole input file (header included), shared by all threads when in_memory > 0
+size_t rec_mapping_size = 0;
+
+// Placement of the parameters and of the training threads
+int huge_pages = 0; // 0: normal pages; 1: transparent huge pages; 2: explicit huge pages (MAP_HUGETLB), falling back to 1 if none are reserved
+int numa_interleave = 0; // Interleave the pages of W and gradsq across all online NUMA nodes
+int pin_threads = 0; // Pin each training thread to its own CPU
+int *thread_cpus = NULL; // CPU of each training thread when pinning
+
+// Epoch scheduling shared by the persistent worker threads
+typedef struct chunk_queue {
+    long long next; // Next unclaimed chunk, advanced atomically by the owner and by thieves
+    long long end;
+    char pad[64 - 2 * sizeof(long long)]; // One queue per cache line
+} CHUNKQ;
+CHUNKQ *chunk_queues;
+pthread_barrier_t epoch_start, epoch_end;
+volatile int training_done = 0;
+
+// Conflict-free schedule: word ids and context ids are each split into G ranges, and step s of an epoch trains on the
+// blocks (i, (i + s) % G), which share no rows, so no two threads ever update the same row of W. Threads claim whole blocks.
+int schedule = 0; // 0: Hogwild, threads race on shared rows; 1: G x G blocks
+int block_grid = 0; // G; 0: four times the number of threads
+int deterministic = 0; // Conflict-free schedule with a fixed block-to-thread assignment: bit-identical results for a given number of threads
+char **block_records = NULL; // Records of block (i, j) at [i * block_grid + j], in the input format (decoded to CRECF for RECFMT_BLOCK)
+long long *block_counts = NULL;
+long long bucket_record_size;
+int *step_next = NULL; // Next unclaimed block row of each step
+int epoch_step = 0; // Diagonal the current epoch starts with
+pthread_barrier_t step_barrier;
+
+// Checkpointing
+typedef struct checkpoint_header { // Followed by W and then gradsq, as reals of the build that wrote the file
+    char magic[8];
+    int real_size;
+    int vector_size;
+    long long vocab_size;
+    long long num_lines;
+    int iter; // Number of completed iterations
+    int num_models; // W and gradsq of each model follow in turn; 0 in checkpoints of a single model
+    double eta, alpha, x_max;
+    unsigned long long forcing_hash; // Hash of the forcing index (forced dims, words, polarities and k-values)
+} CKPTHDR;
+char *checkpoint_file;
+int checkpoint_every = 0; // Write a checkpoint every <int> iterations; 0: off
+real checkpoint_minutes = 0; // Also write one once this many minutes have passed since the last; 0: off
+int resume_training = 0; // Continue from checkpoint_file instead of starting from the initialization file
+int start_iter = 0; // Iterations already completed (nonzero when resuming)
+unsigned long long forcing_hash = FNV1A_BASIS; // Chained over the models
+char *checkpoint_snapshot = NULL; // Header, W and gradsq copied at an epoch boundary, written out by a background thread
+size_t checkpoint_bytes = 0;
+pthread_t checkpoint_thread;
+int checkpoint_pending = 0;
+
+// Starting from a trained model: either the same vocabulary (warm start, to fine-tune with other forcing parameters), or an
+// older one (vocabulary extension), in which case only the records that involve new words are trained on
+int warm_start = 0; // Start from the trained W and gradsq instead of the initialization file
+int finetune_iter = 5; // Iterations of a warm start, in place of -iter
+real finetune_eta = -1; // Learning rate of a warm start; negative: the same as -eta
+char *extend_vocab_file = NULL; // Vocabulary of the trained model when it differs from the current one; NULL: off
+char *trained_vectors_file, *trained_gradsq_file; // W and gradsq of the trained model, as saved by save_params in binary
+int update_old = 0; // 0: the rows of words already in the trained model stay as they are; 1: update them too
+long long trained_vocab_size = 0;
+long long *trained_row = NULL; // Row of word w (frequency rank) in the trained model; -1 for a new word
+char *frozen_word = NULL; // Nonzero for the words whose rows are not updated, by word id; NULL: none
 
 
 // Toggles used for debugging
-int ignore_init_file = 0; // Set to 1 to randomly generate the initial parameter values instead.
+int ignore_init_file = 0; // Set to 1 to randomly generate the initial parameter values instead, or to 2 to generate them in parallel with a counter-based generator.
+unsigned int seed = 1; // Seed of the random initial values; for rand(), 1 is what an unseeded rand() uses
 int forcing_enabled = 1; // Setting to 0 disables dim force by setting numForcedDims to 0
+int forcing_mode = 0; // 0: forcing gradient on every record of a forced word; 1: one proximal step per forced word and epoch, weighted by its total f(X)
+double *forcing_weights = NULL; // Lazy forcing: total f(X) of word w at [w] and of context w at [vocab_size + 1 + w], summed over the threads
+int forcing_weights_ready = 0; // The totals are counted during the first epoch, then fixed
 //
 // The following are required to be read from a file
 int *forcedDims = 0; // 0..(vector_size-1).
@@ -73,6 +200,27 @@ int *numWordsPerForcedDim;
 //
 // Globally defined for convenience (want to see the string forms of the forced words at all times during debugging)
 char ***wordStringsPerForcedDim;
+//
+// Per-word forcing index (CSR layout, built once after the files are read).
+// The forced entries of word w (frequency rank) are forceOffsets[w]..forceOffsets[w+1]-1
+int *forceOffsets;
+int *forceDims;
+int *forcePols;
+real *forceKvals;
+
+// Several models trained side by side on the same records, one per set of polarities and k-values (-POLS_FILE and -KVALS_FILE lists).
+// Each has its own parameters, forcing and output files; the globals above (and W, gradsq, the file names) are those of the model in use.
+typedef struct model {
+    real *W, *gradsq;
+    char *polarities_file, *k_vals_file;
+    char *save_W_file, *save_gradsq_file;
+    int **polaritiesPerForcedDim;
+    real **kvalsPerForcedDim;
+    int *forceOffsets, *forceDims, *forcePols;
+    real *forceKvals;
+} MODEL;
+MODEL *models;
+int num_models = 1;
 
 
 // File names
@@ -89,22 +237,204 @@ int scmp( char *s1, char *s2 ) {
     return(*s1 - *s2);
 }
 
-void initialize_parameters() {
-    real* W_temp;
+int load_checkpoint();
+int load_trained_rows();
+
+/* Set the memory policy of [p, p + bytes) to interleave across the online NUMA nodes; must be done before first touch */
+int interleave_pages(void *p, size_t bytes) {
+    unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))] = {0};
+    int lo, hi, n;
+    char sep;
+    FILE *fnodes = fopen("/sys/devices/system/node/online", "r");
+    
+    if(fnodes == NULL) return 1;
+    while((n = fscanf(fnodes, "%d", &lo)) == 1) { // e.g. "0-1,3"
+        hi = lo;
+        sep = fgetc(fnodes);
+        if(sep == '-') {
+            if(fscanf(fnodes, "%d", &hi) != 1) break;
+            sep = fgetc(fnodes);
+        }
+        for(; lo <= hi && lo < MAX_NUMA_NODES; lo++) mask[lo / (8 * sizeof(unsigned long))] |= 1UL << (lo % (8 * sizeof(unsigned long)));
+        if(sep != ',') break;
+    }
+    fclose(fnodes);
+    return syscall(SYS_mbind, p, bytes, MPOL_INTERLEAVE, mask, MAX_NUMA_NODES + 1, 0) != 0;
+}
+
+/* Allocate W or gradsq, on huge pages and/or interleaved across NUMA nodes if requested. Mappings start on a huge page and are
+   followed by a huge page of guard region, so the kernel keeps W and gradsq in separate mappings. */
+real *allocate_parameters(size_t bytes, const char *name) {
+    void *p = NULL;
+    char *raw;
+    size_t length, head;
+    
+    if(huge_pages == 0 && !numa_interleave) {
+        if(posix_memalign(&p, 128, bytes) != 0) p = NULL; // Might perform better than malloc
+        if(p == NULL) {fprintf(stderr, "Error allocating memory for %s\n", name); exit(1);}
+        return (real *)p;
+    }
+    length = (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    if(huge_pages == 2) {
+        p = mmap(NULL, length + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(p != MAP_FAILED) mprotect((char *)p + length, HUGE_PAGE_SIZE, PROT_NONE);
+        else {
+            fprintf(stderr, "No explicit huge pages available for %s, using transparent huge pages.\n", name);
+            huge_pages = 1;
+            p = NULL;
+        }
+    }
+    if(p == NULL) {
+        // mmap only aligns to base pages: map one huge page more than needed, then unmap what is before the first huge page boundary and past the guard
+        raw = mmap(NULL, length + 2 * HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(raw == MAP_FAILED) {fprintf(stderr, "Error allocating memory for %s\n", name); exit(1);}
+        head = (HUGE_PAGE_SIZE - (size_t)raw % HUGE_PAGE_SIZE) % HUGE_PAGE_SIZE;
+        if(head > 0) munmap(raw, head);
+        if(head < HUGE_PAGE_SIZE) munmap(raw + head + length + HUGE_PAGE_SIZE, HUGE_PAGE_SIZE - head);
+        p = raw + head;
+        mprotect((char *)p + length, HUGE_PAGE_SIZE, PROT_NONE);
+        if(huge_pages == 1 && madvise(p, length, MADV_HUGEPAGE) != 0) fprintf(stderr, "Transparent huge pages unavailable for %s.\n", name);
+    }
+    if(numa_interleave && interleave_pages(p, length) != 0) fprintf(stderr, "Unable to interleave %s across NUMA nodes.\n", name);
+    return (real *)p;
+}
+
+/* Release W or gradsq as allocated by allocate_parameters */
+void free_parameters(real *p, size_t bytes) {
+    if(p == NULL) return;
+    if(huge_pages == 0 && !numa_interleave) free(p);
+    else munmap(p, ((bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1)) + HUGE_PAGE_SIZE);
+}
+
+/* Report how much of the mapping of [p, p + bytes) is backed by huge pages and how its pages are spread over NUMA nodes */
+void report_placement(void *p, size_t bytes, const char *name) {
+    char line[MAX_STRING_LENGTH];
+    unsigned long start, end, begin = (unsigned long)p, finish = (unsigned long)p + bytes;
+    long long kb, huge_kb = 0, node_pages[64] = {0};
+    int inside = 0, a, n, samples = 1024;
+    long page_size = sysconf(_SC_PAGESIZE);
+    void **pages;
+    int *status;
+    FILE *fsmaps = fopen("/proc/self/smaps", "r");
+    
+    bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1); // Whole mapping, as made by allocate_parameters
+    finish = begin + bytes;
+    if(fsmaps != NULL) {
+        while(fgets(line, MAX_STRING_LENGTH, fsmaps) != NULL) {
+            if(sscanf(line, "%lx-%lx ", &start, &end) == 2 && strchr(line, '-') < strchr(line, ' ')) inside = start < finish && end > begin;
+            else if(inside && (sscanf(line, "AnonHugePages: %lld", &kb) == 1 || sscanf(line, "Private_Hugetlb: %lld", &kb) == 1)) huge_kb += kb;
+        }
+        fclose(fsmaps);
+        fprintf(stderr, "%s: %lld of %lld kB on huge pages\n", name, huge_kb, (long long)(bytes >> 10));
+    }
+    
+    // Sample the node of evenly spaced pages
+    if(bytes / page_size < samples) samples = bytes / page_size;
+    if(samples < 1) return;
+    pages = malloc(sizeof(void *) * samples);
+    status = malloc(sizeof(int) * samples);
+    for(a = 0; a < samples; a++) pages[a] = (char *)p + ((bytes / page_size) * a / samples) * page_size;
+    if(syscall(SYS_move_pages, 0, samples, pages, NULL, status, 0) == 0) {
+        for(a = 0; a < samples; a++) if(status[a] >= 0 && status[a] < 64) node_pages[status[a]]++;
+        fprintf(stderr, "%s: pages per NUMA node (of %d sampled):", name, samples);
+        for(n = 0; n < 64; n++) if(node_pages[n] > 0) fprintf(stderr, " node %d: %lld", n, node_pages[n]);
+        fprintf(stderr, "\n");
+    }
+    free(pages);
+    free(status);
+}
+
+/* Choose a CPU for each training thread, in order among those the process may run on */
+void assign_thread_cpus() {
+    cpu_set_t allowed;
+    int a, cpu = -1, count;
+    
+    if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || (count = CPU_COUNT(&allowed)) == 0) {
+        fprintf(stderr, "Unable to read CPU affinity, not pinning threads.\n");
+        pin_threads = 0;
+        return;
+    }
+    thread_cpus = malloc(sizeof(int) * num_threads);
+    for(a = 0; a < num_threads; a++) {
+        if(a % count == 0) cpu = -1; // More threads than CPUs: wrap around
+        do cpu++; while(!CPU_ISSET(cpu, &allowed));
+        thread_cpus[a] = cpu;
+    }
+    if(verbose > 0) {
+        fprintf(stderr, "Pinned threads to CPUs %d", thread_cpus[0]);
+        for(a = 1; a < num_threads; a++) fprintf(stderr, ", %d", thread_cpus[a]);
+        fprintf(stderr, "\n");
+    }
+}
+
+/* Pin the calling thread to the CPU of training thread id */
+void pin_thread(long long id) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(thread_cpus[id], &cpus);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) fprintf(stderr, "Unable to pin thread %lld to CPU %d.\n", id, thread_cpus[id]);
+}
+
+/* Random initial values for 1/num_threads of the rows of W, and gradsq of 1 for them. The pages are first touched here,
+   by a thread on the CPU of training thread id when pinning, so they are placed on its NUMA node. */
+void *init_rows_thread(void *vid) {
+    long long id = (long long) vid, a, b, row_size = vector_size + 1;
+    long long first = 2 * vocab_size * id / num_threads, last = 2 * vocab_size * (id + 1) / num_threads;
+    if(pin_threads) pin_thread(id);
+    for(a = first; a < last; a++) {
+        initRandomRow(W + a * row_size, row_size, a, seed);
+        for(b = 0; b < row_size; b++) gradsq[a * row_size + b] = 1.0; // So initial value of eta is equal to initial learning rate
+    }
+    return NULL;
+}
+
+/* Make model m the one in use: point W, gradsq, the forcing index and the file names at its own */
+void select_model(int m) {
+    W = models[m].W;
+    gradsq = models[m].gradsq;
+    polaritiesPerForcedDim = models[m].polaritiesPerForcedDim;
+    kvalsPerForcedDim = models[m].kvalsPerForcedDim;
+    forceOffsets = models[m].forceOffsets;
+    forceDims = models[m].forceDims;
+    forcePols = models[m].forcePols;
+    forceKvals = models[m].forceKvals;
+    polarities_file = models[m].polarities_file;
+    k_vals_file = models[m].k_vals_file;
+    save_W_file = models[m].save_W_file;
+    save_gradsq_file = models[m].save_gradsq_file;
+}
+
+/* Make the forcing parameters and index just read those of model m */
+void keep_forcing(int m) {
+    models[m].polaritiesPerForcedDim = polaritiesPerForcedDim;
+    models[m].kvalsPerForcedDim = kvalsPerForcedDim;
+    models[m].forceOffsets = forceOffsets;
+    models[m].forceDims = forceDims;
+    models[m].forcePols = forcePols;
+    models[m].forceKvals = forceKvals;
+}
+
+/* Initial values of W and gradsq of the model in use */
+void initialize_model() {
     long long a, b;
     FILE* finit;
-    vector_size++; // Temporarily increment to allocate space for bias
-    
-    /* Allocate space for word vectors and context word vectors, and correspodning gradsq */
-    a = posix_memalign((void **)&W, 128, 2 * vocab_size * vector_size * sizeof(real)); // Might perform better than malloc
-    if (W == NULL) {
-        fprintf(stderr, "Error allocating memory for W\n");
-        exit(1);
+    vector_size++; // Temporarily increment for the bias
+
+    if(warm_start || extend_vocab_file != NULL){
+        // Rows of the words already trained come from the trained model, the others are random
+        vector_size--;
+        if(load_trained_rows() != 0) exit(1);
+        return;
     }
-    a = posix_memalign((void **)&gradsq, 128, 2 * vocab_size * vector_size * sizeof(real)); // Might perform better than malloc
-    if (gradsq == NULL) {
-        fprintf(stderr, "Error allocating memory for gradsq\n");
-        exit(1);
+
+    if(ignore_init_file == 2){
+        // Counter-based random init, in parallel: the values depend on the seed only, not on the number of threads
+        pthread_t *pt = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
+        vector_size--;
+        for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, init_rows_thread, (void *)a);
+        for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+        free(pt);
+        return;
     }
 
     if(!ignore_init_file){
@@ -112,11 +442,12 @@ void initialize_parameters() {
         finit = fopen(init_file, "rb");
         if(finit == NULL) {fprintf(stderr, "Unable to open file %s.\n", init_file); exit(1);}
         // Read from file
-        fread(W, sizeof(real), 2 * (long long)vocab_size * vector_size, finit);
+        readReals(W, 2 * (long long)vocab_size * vector_size, finit);
         fclose(finit);
     }
     else{
         // Random-init
+        srand(seed);
         for (b = 0; b < vector_size; b++) for (a = 0; a < 2 * vocab_size; a++) W[a * vector_size + b] = (rand() / (real)RAND_MAX - 0.5) / vector_size;
     }
 
@@ -125,203 +456,687 @@ void initialize_parameters() {
     vector_size--;
 }
 
-/* Train the GloVe model */
-void *glove_thread(void *vid) {
-    long long a;
-    long long id = (long long) vid;
-    CREC cr;
-    FILE *fin;
+void initialize_parameters() {
+    int m;
+    size_t bytes = 2 * vocab_size * (vector_size + 1) * sizeof(real); // Plus one for the bias
+
+    /* Allocate space for word vectors and context word vectors, and correspodning gradsq */
+    for(m = 0; m < num_models; m++) {
+        models[m].W = allocate_parameters(bytes, "W");
+        models[m].gradsq = allocate_parameters(bytes, "gradsq");
+    }
+    select_model(0);
+
+    if(resume_training){
+        // Parameters and squared gradients of all models come from the checkpoint
+        if(load_checkpoint() != 0) exit(1);
+        return;
+    }
+
+    // Every model starts from the same values
+    initialize_model();
+    for(m = 1; m < num_models; m++) {
+        memcpy(models[m].W, W, bytes);
+        memcpy(models[m].gradsq, gradsq, bytes);
+    }
+}
 
+/* Train model md on one cooccurrence of word1 and word2, with log X and weight f(X); costs and counts are added to acc */
+static inline void train_record(THREADSTATS *acc, const MODEL *md, int word1, int word2, real logx, real weight, WORKSPACE *ws) {
     // Forced dims/pols/kvals for the word pair under consideration
     int w1_num_forced_dims;
-    int* word1_forced_dims = (int*) malloc(sizeof(int) * numForcedDims);
-    int* word1_forced_dim_pols = (int*) malloc(sizeof(int) * numForcedDims);
-    real* word1_kvals =  (real*) malloc(sizeof(real) * numForcedDims);
+    int *word1_forced_dims, *word1_forced_dim_pols;
+    real *word1_kvals;
     //
     int w2_num_forced_dims;
-    int* word2_forced_dims = (int*) malloc(sizeof(int) * numForcedDims);
-    int* word2_forced_dim_pols = (int*) malloc(sizeof(int) * numForcedDims);
-    real* word2_kvals =  (real*) malloc(sizeof(real) * numForcedDims);
+    int *word2_forced_dims, *word2_forced_dim_pols;
+    real *word2_kvals;
     //
 
-    fin = fopen(input_file, "rb");
-    fseeko(fin, (num_lines / num_threads * id) * (sizeof(CREC)), SEEK_SET); //Threads spaced roughly equally throughout file
-    cost[id] = 0;
-    
-    for(a = 0; a<lines_per_thread[id]; a++)
     {
-        fread(&cr, sizeof(CREC), 1, fin);
-        if(feof(fin)) break;
-
-        // Set the forced dims/pols/kvals vectors for both words
-        {
-            int i,j;
-            w1_num_forced_dims = 0; w2_num_forced_dims=0;
-            memset(word1_forced_dims, 0, numForcedDims * sizeof(int));
-            memset(word2_forced_dims, 0, numForcedDims * sizeof(int));
-            for(i=0;i<numForcedDims;i++)
-                for(j=0;j<numWordsPerForcedDim[i];j++){
-                    if(wordIdsPerForcedDim[i][j] == cr.word1){
-                        word1_forced_dims[w1_num_forced_dims] = forcedDims[i];
-                        word1_forced_dim_pols[w1_num_forced_dims] = polaritiesPerForcedDim[i][j];
-                        word1_kvals[w1_num_forced_dims] = kvalsPerForcedDim[i][j];
-                        w1_num_forced_dims++;
-                    }
-                    if(wordIdsPerForcedDim[i][j] == cr.word2){
-                        word2_forced_dims[w2_num_forced_dims] = forcedDims[i];
-                        word2_forced_dim_pols[w2_num_forced_dims] = polaritiesPerForcedDim[i][j];
-                        word2_kvals[w2_num_forced_dims] = kvalsPerForcedDim[i][j];
-                        w2_num_forced_dims++;
-                    }
-                }
+        // Look up the forced dims/pols/kvals of both words in the per-word index; lazy forcing leaves them out of the records
+        if(forcing_mode == 1) {
+            w1_num_forced_dims = w2_num_forced_dims = 0;
+            word1_forced_dims = word1_forced_dim_pols = word2_forced_dims = word2_forced_dim_pols = NULL;
+            word1_kvals = word2_kvals = NULL;
+            if(ws->forcing_weights != NULL && md == models) {
+                ws->forcing_weights[word1] += weight;
+                ws->forcing_weights[vocab_size + 1 + word2] += weight;
+            }
+        }
+        else {
+            int f;
+            f = md->forceOffsets[word1];
+            w1_num_forced_dims = md->forceOffsets[word1 + 1] - f;
+            word1_forced_dims = md->forceDims + f;
+            word1_forced_dim_pols = md->forcePols + f;
+            word1_kvals = md->forceKvals + f;
+
+            f = md->forceOffsets[word2];
+            w2_num_forced_dims = md->forceOffsets[word2 + 1] - f;
+            word2_forced_dims = md->forceDims + f;
+            word2_forced_dim_pols = md->forcePols + f;
+            word2_kvals = md->forceKvals + f;
         }
 
         // Cost and gradient calculations
         {
             long long l1, l2;
-            real k_w1, k_w2;
-            real dotprod;
-            real weight;
+            int i, d, n1, n2;
+            real diff, temp, gradient;
+            real *w1, *w2, *gs1, *gs2; // Rows of the two words and their squared gradients
+            real cost_forced_term = 0.0;
 
             // Positions of the two words in the W & gradsq structures
-            l1 = (cr.word1 - 1LL) * (vector_size + 1); // cr word indices start at 1
-            l2 = ((cr.word2 - 1LL) + vocab_size) * (vector_size + 1); // shift by vocab_size to get separate vectors for context words
-
-            // Cost calculation
-            {
-                int i;
-                real diff;
-                real bias1, bias2;
-                real cost_forced_term = 0.0;
-                real val; int pol;
-                real cost1_del, cost2_del;
-
-                // Bias terms
-                bias1 = W[l1 + vector_size];
-                bias2 = W[l2 + vector_size];
-
-                // The dot product of the first word vector and the second context vector
-                dotprod = dot(W+l1, W+l2, vector_size);
-                dotprod = dotprod + bias1 + bias2; // Add the biases
-
-                // The difference between word-vector inner products and the log-cooccurrence
-                diff = dotprod - log(cr.val);
-
-                // The cost term due to the forced dimensions for the two words
-                for(i=0; i<w1_num_forced_dims; i++){
-                    k_w1 = word1_kvals[i];
-                    val = *(W + l1 + word1_forced_dims[i]);
-                    pol = word1_forced_dim_pols[i];
-                    cost1_del = recipCost(val, pol, k_w1);
-                    cost_forced_term += recipCost(val, pol, k_w1);
+            l1 = (word1 - 1LL) * (vector_size + 1); // cr word indices start at 1
+            l2 = ((word2 - 1LL) + vocab_size) * (vector_size + 1); // shift by vocab_size to get separate vectors for context words
+            w1 = md->W + l1; w2 = md->W + l2;
+            gs1 = md->gradsq + l1; gs2 = md->gradsq + l2;
+
+            // Rows of frozen words are updated in a scratch copy that is thrown away
+            if(frozen_word != NULL) {
+                if(frozen_word[word1]) {
+                    memcpy(ws->frozen_rows, w1, sizeof(real) * (vector_size + 1));
+                    memcpy(ws->frozen_rows + (vector_size + 1), gs1, sizeof(real) * (vector_size + 1));
+                    w1 = ws->frozen_rows; gs1 = ws->frozen_rows + (vector_size + 1);
                 }
-                for(i=0; i<w2_num_forced_dims; i++){
-                    k_w2 = word2_kvals[i];
-                    val = *(W + l2 + word2_forced_dims[i]);
-                    pol = word2_forced_dim_pols[i];
-                    cost2_del = recipCost(val, pol, k_w2);
-                    cost_forced_term += recipCost(val, pol, k_w2);
+                if(frozen_word[word2]) {
+                    memcpy(ws->frozen_rows + 2 * (vector_size + 1), w2, sizeof(real) * (vector_size + 1));
+                    memcpy(ws->frozen_rows + 3 * (vector_size + 1), gs2, sizeof(real) * (vector_size + 1));
+                    w2 = ws->frozen_rows + 2 * (vector_size + 1); gs2 = ws->frozen_rows + 3 * (vector_size + 1);
                 }
+            }
 
-                // The weight term for the squared-error cost
-                weight = (cr.val > x_max) ? 1 : pow(cr.val / x_max, alpha);
+            // The cost term due to the forced dimensions for the two words
+            for(i=0; i<w1_num_forced_dims; i++) cost_forced_term += recipCost(w1[word1_forced_dims[i]], word1_forced_dim_pols[i], word1_kvals[i]);
+            for(i=0; i<w2_num_forced_dims; i++) cost_forced_term += recipCost(w2[word2_forced_dims[i]], word2_forced_dim_pols[i], word2_kvals[i]);
+
+            // Keep the pre-update values of the forced components (own value, own gradsq, value in the other row).
+            // Only the leading run of ascending dims receives the forced gradient, as the component loop matches them in order.
+            for(n1=0; n1<w1_num_forced_dims && (n1 == 0 || word1_forced_dims[n1] > word1_forced_dims[n1-1]); n1++){
+                d = word1_forced_dims[n1];
+                ws->forced_state1[3*n1] = w1[d]; ws->forced_state1[3*n1+1] = gs1[d]; ws->forced_state1[3*n1+2] = w2[d];
+            }
+            for(n2=0; n2<w2_num_forced_dims && (n2 == 0 || word2_forced_dims[n2] > word2_forced_dims[n2-1]); n2++){
+                d = word2_forced_dims[n2];
+                ws->forced_state2[3*n2] = w2[d]; ws->forced_state2[3*n2+1] = gs2[d]; ws->forced_state2[3*n2+2] = w1[d];
+            }
 
-                // Calculate the cost
-                cost[id] += 0.5 * weight * (diff * diff + cost_forced_term);
+            // Dot product and Adagrad updates of both rows and biases in one branch-free pass
+            diff = adagradStep(w1, w2, gs1, gs2, vector_size, logx, weight, eta);
+
+            // Calculate the cost
+            acc->cost += 0.5 * weight * diff * diff;
+            acc->cost_forced += 0.5 * weight * cost_forced_term;
+            acc->forced_hits += (w1_num_forced_dims > 0) + (w2_num_forced_dims > 0);
+
+            // Patch the forced components: redo their updates from the saved values with the forced term added to the gradient
+            temp = weight * diff;
+            for(i=0; i<n1; i++){
+                d = word1_forced_dims[i];
+                gradient = temp * ws->forced_state1[3*i+2] + weight * recipCostDer(ws->forced_state1[3*i], word1_forced_dim_pols[i], word1_kvals[i]);
+                w1[d] = ws->forced_state1[3*i] - (eta*gradient) / sqrt(ws->forced_state1[3*i+1]);
+                gs1[d] = ws->forced_state1[3*i+1] + eta*gradient * eta*gradient;
             }
+            for(i=0; i<n2; i++){
+                d = word2_forced_dims[i];
+                gradient = temp * ws->forced_state2[3*i+2] + weight * recipCostDer(ws->forced_state2[3*i], word2_forced_dim_pols[i], word2_kvals[i]);
+                w2[d] = ws->forced_state2[3*i] - (eta*gradient) / sqrt(ws->forced_state2[3*i+1]);
+                gs2[d] = ws->forced_state2[3*i+1] + eta*gradient * eta*gradient;
+            }
+        }
+    }
+}
+
+/* Train every model on n consecutive records of the input file; stats holds one entry per model. With several models, log X and f(X)
+   are computed once into ws->decoded and the models take turns over the whole batch, so only one model's rows are in use at a time. */
+void train_records(THREADSTATS *stats, const char *records, long long n, WORKSPACE *ws) {
+    long long a;
+    int m;
+    THREADSTATS acc[num_models];
+    memset(acc, 0, sizeof(acc));
+
+    if(record_format == RECFMT_TRAIN) {
+        const TREC *tr = (const TREC *)records;
+        for(m = 0; m < num_models; m++) for(a = 0; a < n; a++) train_record(&acc[m], &models[m], tr[a].word1, tr[a].word2, tr[a].logx, tr[a].fx, ws);
+    }
+    else if(num_models == 1) {
+        if(record_format == RECFMT_COMPACT || record_format == RECFMT_BLOCK) { // Blocks are decoded before they get here
+            const CRECF *cr = (const CRECF *)records;
+            for(a = 0; a < n; a++, cr++) train_record(&acc[0], &models[0], cr->word1, cr->word2, log((real)cr->val), (cr->val > x_max) ? 1 : pow(cr->val / x_max, alpha), ws);
+        }
+        else {
+            const CREC *cr = (const CREC *)records;
+            // The weight term for the squared-error cost
+            for(a = 0; a < n; a++, cr++) train_record(&acc[0], &models[0], cr->word1, cr->word2, log(cr->val), (cr->val > x_max) ? 1 : pow(cr->val / x_max, alpha), ws);
+        }
+    }
+    else {
+        WREC *wr;
+        if(n > ws->decoded_size) {
+            ws->decoded_size = n;
+            ws->decoded = (WREC *) realloc(ws->decoded, sizeof(WREC) * n);
+        }
+        wr = ws->decoded;
+        if(record_format == RECFMT_COMPACT || record_format == RECFMT_BLOCK) {
+            const CRECF *cr = (const CRECF *)records;
+            for(a = 0; a < n; a++, cr++) {
+                wr[a].word1 = cr->word1; wr[a].word2 = cr->word2;
+                wr[a].logx = log((real)cr->val); wr[a].weight = (cr->val > x_max) ? 1 : pow(cr->val / x_max, alpha);
+            }
+        }
+        else {
+            const CREC *cr = (const CREC *)records;
+            for(a = 0; a < n; a++, cr++) {
+                wr[a].word1 = cr->word1; wr[a].word2 = cr->word2;
+                wr[a].logx = log(cr->val); wr[a].weight = (cr->val > x_max) ? 1 : pow(cr->val / x_max, alpha);
+            }
+        }
+        for(m = 0; m < num_models; m++) for(a = 0; a < n; a++) train_record(&acc[m], &models[m], wr[a].word1, wr[a].word2, wr[a].logx, wr[a].weight, ws);
+    }
+
+    for(m = 0; m < num_models; m++) {
+        stats[m].cost += acc[m].cost;
+        stats[m].cost_forced += acc[m].cost_forced;
+        stats[m].forced_hits += acc[m].forced_hits;
+    }
+    stats->records += n;
+}
+
+double clock_seconds(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Claim the next chunk of the current epoch, from the thread's own range first and then by stealing from the others; -1 when none are left */
+long long next_chunk(long long id) {
+    long long c, t, victim;
+    for(t = 0; t < num_threads; t++) {
+        victim = (id + t) % num_threads;
+        if(__atomic_load_n(&chunk_queues[victim].next, __ATOMIC_RELAXED) >= chunk_queues[victim].end) continue;
+        c = __atomic_fetch_add(&chunk_queues[victim].next, 1, __ATOMIC_RELAXED);
+        if(c < chunk_queues[victim].end) return c;
+    }
+    return -1;
+}
+
+/* Get the records of chunk c, in place or read into buf (and decoded into decoded for RECFMT_BLOCK); sets *n to their number */
+const char *load_chunk(long long c, long long *n, FILE *fin, char *buf, CRECF *decoded, THREADSTATS *stats) {
+    long long start, bytes;
+    const char *recs;
+    double t_io = 0;
+
+    if(record_format == RECFMT_BLOCK) {
+        *n = block_starts[c + 1] - block_starts[c];
+        bytes = block_offsets[c + 1] - block_offsets[c] - sizeof(RECBLOCKHDR);
+        start = block_offsets[c] + sizeof(RECBLOCKHDR);
+    }
+    else {
+        start = c * chunk_size;
+        *n = (num_lines - start < chunk_size) ? num_lines - start : chunk_size;
+        bytes = *n * record_size;
+        start = record_offset + start * record_size;
+    }
+    if(rec_mapping != NULL) recs = (const char *)rec_mapping + start; // Walk the chunk in place
+    else {
+        t_io = clock_seconds(CLOCK_MONOTONIC);
+        fseeko(fin, start, SEEK_SET);
+        bytes = fread(buf, 1, bytes, fin);
+        stats->io_seconds += clock_seconds(CLOCK_MONOTONIC) - t_io;
+        if(record_format != RECFMT_BLOCK) *n = bytes / record_size;
+        recs = buf;
+    }
+    if(record_format == RECFMT_BLOCK) {
+        decodeRecordBlock((const unsigned char *)recs, *n, decoded);
+        recs = (const char *)decoded;
+    }
+    return recs;
+}
+
+/* Assign ids 1..vocab_size to block_grid contiguous ranges holding about the same number of records */
+void partition_ids(const long long *counts, long long total, int *part) {
+    long long id, seen = 0;
+    for(id = 1; id <= vocab_size; id++) {
+        part[id] = (total > 0) ? seen * block_grid / total : 0;
+        seen += counts[id];
+    }
+}
+
+/* Read all records once and copy them into the blocks of the conflict-free schedule, keeping their order within each block */
+int bucket_records() {
+    long long a, c, n, num_chunks, *word_counts, *context_counts, *filled;
+    int *word_part, *context_part, pass, w1, w2;
+    const char *recs, *r;
+    char *chunk_buf = NULL;
+    CRECF *decoded = NULL;
+    FILE *fin = NULL;
+    THREADSTATS io;
+
+    num_chunks = (record_format == RECFMT_BLOCK) ? num_blocks : (num_lines + chunk_size - 1) / chunk_size;
+    bucket_record_size = (record_format == RECFMT_BLOCK) ? sizeof(CRECF) : record_size;
+    if(rec_mapping == NULL) {
+        fin = fopen(input_file, "rb");
+        if(fin == NULL) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
+        chunk_buf = (char *) malloc((record_format == RECFMT_BLOCK) ? max_block_bytes : record_size * chunk_size);
+    }
+    if(record_format == RECFMT_BLOCK) decoded = (CRECF *) malloc(sizeof(CRECF) * max_block_records);
+    word_counts = (long long *) calloc(vocab_size + 2, sizeof(long long));
+    context_counts = (long long *) calloc(vocab_size + 2, sizeof(long long));
+    word_part = (int *) malloc(sizeof(int) * (vocab_size + 2));
+    context_part = (int *) malloc(sizeof(int) * (vocab_size + 2));
+    block_counts = (long long *) calloc((long long)block_grid * block_grid, sizeof(long long));
+    filled = (long long *) calloc((long long)block_grid * block_grid, sizeof(long long));
+    block_records = (char **) malloc(sizeof(char *) * block_grid * block_grid);
+    if((rec_mapping == NULL && chunk_buf == NULL) || (record_format == RECFMT_BLOCK && decoded == NULL) || word_counts == NULL || context_counts == NULL
+        || word_part == NULL || context_part == NULL || block_counts == NULL || filled == NULL || block_records == NULL) {
+        fprintf(stderr, "Error allocating memory for the record blocks\n");
+        return 1;
+    }
 
-            // Adagrad updates
-            {
-                real temp = weight * (dotprod - log(cr.val));
-                real gradient_w1, gradient_w2, gradient_b;
-                int i;
-                int matches_1 = 0, matches_2 = 0;
-                real val; int pol;
-
-                // Updates for each component:
-                for(i=0; i<vector_size; i++)
-                {
-                    // Gradient for word 1 (actual)
-                    gradient_w1 = temp * W[l2 + i];
-                    // Gradient for word 2 (context)
-                    gradient_w2 = temp * W[l1 + i];
-
-                    // Gradient from the forced term for word 1
-                    if(matches_1<w1_num_forced_dims && i == word1_forced_dims[matches_1]){
-                        val = *(W + l1 + i);
-                        pol = word1_forced_dim_pols[matches_1];
-                        k_w1 = word1_kvals[matches_1];
-
-                        gradient_w1 += weight*recipCostDer(val, pol, k_w1);
-                        matches_1++;
-                    }
-
-                    // Gradient from the forced term for word 2
-                    if(matches_2<w2_num_forced_dims && i == word2_forced_dims[matches_2]){
-                        val = *(W + l2 + i);
-                        pol = word2_forced_dim_pols[matches_2];
-                        k_w2 = word2_kvals[matches_2];
-
-                        gradient_w2 += weight*recipCostDer(val, pol, k_w2);
-                        matches_2++;
-                    }
-
-                    // Update for word 1
-                    W[l1 + i] -= (eta*gradient_w1) / sqrt(gradsq[l1 + i]);
-                    gradsq[l1 + i] += eta*gradient_w1 * eta*gradient_w1;
-                    // Update for word 2
-                    W[l2 + i] -= (eta*gradient_w2) / sqrt(gradsq[l2 + i]);
-                    gradsq[l2 + i] += eta*gradient_w2 * eta*gradient_w2;
+    // First pass counts records per word and context id, second pass counts per block, third pass copies
+    for(pass = 0; pass < 3; pass++) {
+        for(c = 0; c < num_chunks; c++) {
+            recs = load_chunk(c, &n, fin, chunk_buf, decoded, &io);
+            for(a = 0, r = recs; a < n; a++, r += bucket_record_size) {
+                w1 = ((const int *)r)[0]; // All record types start with word1 and word2
+                w2 = ((const int *)r)[1];
+                if(pass == 0) {word_counts[w1]++; context_counts[w2]++;}
+                else {
+                    long long b = (long long)word_part[w1] * block_grid + context_part[w2];
+                    if(pass == 1) block_counts[b]++;
+                    else memcpy(block_records[b] + bucket_record_size * filled[b]++, r, bucket_record_size);
                 }
+            }
+        }
+        if(pass == 0) {
+            partition_ids(word_counts, num_lines, word_part);
+            partition_ids(context_counts, num_lines, context_part);
+        }
+        else if(pass == 1) {
+            for(a = 0; a < (long long)block_grid * block_grid; a++) {
+                block_records[a] = (char *) malloc(bucket_record_size * block_counts[a] + 1);
+                if(block_records[a] == NULL) {fprintf(stderr, "Error allocating memory for the record blocks\n"); return 1;}
+            }
+        }
+    }
+    if(verbose > 1) {
+        long long most = 0;
+        for(a = 0; a < (long long)block_grid * block_grid; a++) if(block_counts[a] > most) most = block_counts[a];
+        fprintf(stderr, "Split records into %d x %d blocks; largest holds %lld records (%.2f x the mean).\n", block_grid, block_grid, most, most * (double)block_grid * block_grid / (num_lines > 0 ? num_lines : 1));
+    }
+    if(fin != NULL) fclose(fin);
+    free(chunk_buf);
+    free(decoded);
+    free(word_counts);
+    free(context_counts);
+    free(word_part);
+    free(context_part);
+    free(filled);
+    return 0;
+}
+
+/* Train on blocks claimed from each step of one epoch of the conflict-free schedule, starting with the diagonal shift first_step.
+   In deterministic mode thread id always takes block rows id, id + num_threads, ... instead of claiming them. */
+void train_blocks(long long id, int first_step, THREADSTATS *stats, WORKSPACE *ws) {
+    long long b, start, n;
+    int s, i;
+    for(s = 0; s < block_grid; s++) {
+        for(i = deterministic ? id : __atomic_fetch_add(&step_next[s], 1, __ATOMIC_RELAXED); i < block_grid;
+            i = deterministic ? i + num_threads : __atomic_fetch_add(&step_next[s], 1, __ATOMIC_RELAXED)) {
+            b = (long long)i * block_grid + (i + first_step + s) % block_grid;
+            for(start = 0; start < block_counts[b]; start += chunk_size) {
+                n = (block_counts[b] - start < chunk_size) ? block_counts[b] - start : chunk_size;
+                train_records(stats, block_records[b] + start * bucket_record_size, n, ws);
+            }
+        }
+        pthread_barrier_wait(&step_barrier); // Nobody moves on to the next diagonal until all blocks of this one are done
+    }
+}
 
-                // For the bias terms
-                gradient_b = temp;
+/* Worker thread: lives for the whole run, and trains on the chunks of one epoch between each pair of barriers */
+void *glove_thread(void *vid) {
+    long long id = (long long) vid;
+    long long c, n;
+    double t_wall, t_cpu;
+    THREADSTATS *stats = &thread_stats[id * num_models];
+    const char *recs;
+    char *chunk_buf = NULL;
+    CRECF *decoded = NULL;
+    FILE *fin = NULL;
+
+    WORKSPACE workspace, *ws = &workspace;
+    ws->forced_state1 = (real*) malloc(sizeof(real) * 3 * vector_size);
+    ws->forced_state2 = (real*) malloc(sizeof(real) * 3 * vector_size);
+    ws->frozen_rows = (real*) malloc(sizeof(real) * 4 * (vector_size + 1));
+    ws->decoded = NULL;
+    ws->decoded_size = 0;
+
+    if(pin_threads) pin_thread(id);
+    if(schedule == 0 && rec_mapping == NULL) {
+        fin = fopen(input_file, "rb");
+        if(fin == NULL) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); exit(1);} // The other workers wait at the barriers
+        chunk_buf = (char *) malloc((record_format == RECFMT_BLOCK) ? max_block_bytes : record_size * chunk_size);
+    }
+    if(schedule == 0 && record_format == RECFMT_BLOCK) decoded = (CRECF *) malloc(sizeof(CRECF) * max_block_records);
+
+    while(1) {
+        pthread_barrier_wait(&epoch_start);
+        if(training_done) break;
+        memset(stats, 0, sizeof(THREADSTATS) * num_models);
+        ws->forcing_weights = (forcing_mode == 1 && !forcing_weights_ready) ? forcing_weights + id * 2 * (vocab_size + 1) : NULL;
+        t_wall = clock_seconds(CLOCK_MONOTONIC);
+        t_cpu = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+        if(schedule == 1) train_blocks(id, epoch_step, stats, ws);
+        else while((c = next_chunk(id)) >= 0) {
+            recs = load_chunk(c, &n, fin, chunk_buf, decoded, stats);
+            train_records(stats, recs, n, ws);
+        }
+        stats->wall_seconds = clock_seconds(CLOCK_MONOTONIC) - t_wall;
+        stats->cpu_seconds = clock_seconds(CLOCK_THREAD_CPUTIME_ID) - t_cpu;
+        pthread_barrier_wait(&epoch_end);
+    }
 
-                W[l1 + vector_size] -= (eta * gradient_b) / sqrt(gradsq[l1 + vector_size]);
-                gradsq[l1 + vector_size] += eta*gradient_b * eta*gradient_b;
+    free(ws->forced_state1);
+    free(ws->forced_state2);
+    free(ws->frozen_rows);
+    free(ws->decoded);
+    if(fin != NULL) fclose(fin);
+    free(chunk_buf);
+    free(decoded);
+    return NULL;
+}
 
-                W[l2 + vector_size] -= (eta * gradient_b) / sqrt(gradsq[l2 + vector_size]);
-                gradsq[l2 + vector_size] += eta*gradient_b * eta*gradient_b;
+/* Lazy forcing, run between epochs: once the f(X) totals of the first epoch are summed over the threads, every forced component of a
+   forced word or context row takes one proximal step, weighted by the total f(X) of that row. Its forced cost is added to the first thread. */
+void apply_lazy_forcing() {
+    long long w, t, stride = 2 * (vocab_size + 1);
+    int m, i, d, side, n;
+    double total, cost;
+    const MODEL *md;
+    real *row, *gs;
+
+    if(!forcing_weights_ready) {
+        for(t = 1; t < num_threads; t++) for(w = 0; w < stride; w++) forcing_weights[w] += forcing_weights[t * stride + w];
+        forcing_weights = (double *) realloc(forcing_weights, sizeof(double) * stride);
+        forcing_weights_ready = 1;
+    }
+    for(m = 0; m < num_models; m++) {
+        md = &models[m];
+        cost = 0;
+        for(w = 1; w <= vocab_size; w++) {
+            n = md->forceOffsets[w + 1] - md->forceOffsets[w];
+            if(n == 0 || (frozen_word != NULL && frozen_word[w])) continue;
+            for(side = 0; side < 2; side++) { // Word row, then context row
+                total = forcing_weights[side * (vocab_size + 1) + w];
+                if(total <= 0) continue;
+                row = md->W + ((w - 1) + side * vocab_size) * (vector_size + 1);
+                gs = md->gradsq + ((w - 1) + side * vocab_size) * (vector_size + 1);
+                // As in the per-record form, only the leading run of ascending dims is forced
+                for(i = md->forceOffsets[w]; i < md->forceOffsets[w + 1] && (i == md->forceOffsets[w] || md->forceDims[i] > md->forceDims[i-1]); i++) {
+                    d = md->forceDims[i];
+                    cost += 0.5 * total * recipCost(row[d], md->forcePols[i], md->forceKvals[i]);
+                    row[d] = recipCostProx(row[d], eta * total / sqrt(gs[d]), md->forcePols[i], md->forceKvals[i]);
+                }
             }
         }
-        
+        thread_stats[m].cost_forced += cost;
     }
+}
 
-    // Free up unused memory
-    free(word1_forced_dims);
-    free(word2_forced_dims);
-    free(word1_forced_dim_pols);
-    free(word2_forced_dim_pols);
-    free(word1_kvals);
-    free(word2_kvals);
+/* Append the metrics of one iteration to the metrics file: one line per thread, then one for the iteration */
+void write_metrics(int iter, double wall_seconds) {
+    long long a, records = 0, forced_hits = 0;
+    int m;
+    double cost = 0, cost_forced = 0, cpu_seconds = 0, io_seconds = 0;
+    double thread_cost, thread_cost_forced;
+    long long thread_forced_hits;
+    struct rusage usage;
+    THREADSTATS *st;
+
+    for(a = 0; a < num_threads; a++) {
+        st = &thread_stats[a * num_models];
+        thread_cost = thread_cost_forced = 0;
+        thread_forced_hits = 0;
+        for(m = 0; m < num_models; m++) {
+            thread_cost += st[m].cost;
+            thread_cost_forced += st[m].cost_forced;
+            thread_forced_hits += st[m].forced_hits;
+        }
+        fprintf(fmetrics, "{\"event\": \"thread\", \"iter\": %d, \"thread\": %lld, \"records\": %lld, \"records_per_sec\": %.1f, "
+            "\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"io_wait_seconds\": %.6f, \"cost\": %.9g, \"cost_forced_term\": %.9g, \"forced_word_hits\": %lld}\n",
+            iter, a, st->records, (st->wall_seconds > 0) ? st->records / st->wall_seconds : 0.0,
+            st->wall_seconds, st->cpu_seconds, st->io_seconds, thread_cost, thread_cost_forced, thread_forced_hits);
+        records += st->records;
+        forced_hits += thread_forced_hits;
+        cost += thread_cost;
+        cost_forced += thread_cost_forced;
+        cpu_seconds += st->cpu_seconds;
+        io_seconds += st->io_seconds;
+    }
+    if(num_models > 1) { // Costs above are summed over the models
+        for(m = 0; m < num_models; m++) {
+            thread_cost = thread_cost_forced = 0;
+            thread_forced_hits = 0;
+            for(a = 0; a < num_threads; a++) {
+                st = &thread_stats[a * num_models + m];
+                thread_cost += st->cost;
+                thread_cost_forced += st->cost_forced;
+                thread_forced_hits += st->forced_hits;
+            }
+            fprintf(fmetrics, "{\"event\": \"model\", \"iter\": %d, \"model\": %d, \"cost\": %.9g, \"cost_glove\": %.9g, \"cost_forced_term\": %.9g, \"forced_word_hits\": %lld}\n",
+                iter, m + 1, (thread_cost + thread_cost_forced) / num_lines, thread_cost / num_lines, thread_cost_forced / num_lines, thread_forced_hits);
+        }
+    }
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(fmetrics, "{\"event\": \"iteration\", \"iter\": %d, \"threads\": %d, \"records\": %lld, \"records_per_sec\": %.1f, "
+        "\"wall_seconds\": %.6f, \"cpu_seconds\": %.6f, \"io_wait_seconds\": %.6f, \"cost\": %.9g, \"cost_glove\": %.9g, \"cost_forced_term\": %.9g, "
+        "\"forced_word_hits\": %lld, \"peak_rss_kb\": %ld}\n",
+        iter, num_threads, records, (wall_seconds > 0) ? records / wall_seconds : 0.0, wall_seconds, cpu_seconds, io_seconds,
+        (cost + cost_forced) / num_lines, cost / num_lines, cost_forced / num_lines, forced_hits, usage.ru_maxrss);
+    fflush(fmetrics);
+}
 
-    fclose(fin);
-    pthread_exit(NULL);
+// Text output of a range of rows, formatted by one thread
+typedef struct text_buffer {
+    char *buf;
+    size_t len, cap;
+} TEXTBUF;
+typedef struct text_batch {
+    long long first, last; // Rows; row vocab_size is <unk> when unk_row is set
+    char **words;
+    real *unk_row; // Word and context parameters (with biases) of <unk>
+    TEXTBUF text, gradsq_text;
+} TEXTBATCH;
+
+/* Make room for n more characters */
+char *text_reserve(TEXTBUF *t, size_t n) {
+    if(t->len + n > t->cap) {
+        t->cap = 2 * (t->len + n);
+        t->buf = realloc(t->buf, t->cap);
+    }
+    return t->buf + t->len;
+}
+
+/* Append the word and n values to t as one line */
+void text_row(TEXTBUF *t, const char *word, const real *values, int n, const real *plus) {
+    char number[MAX_REAL_TEXT];
+    size_t word_len = strlen(word);
+    int b, len;
+    memcpy(text_reserve(t, word_len), word, word_len);
+    t->len += word_len;
+    for(b = 0; b < n; b++) { // Each value is formatted aside first: "%lf" of a large one has up to 317 characters
+        len = formatReal(number, plus ? values[b] + plus[b] : values[b], shortest_text);
+        *text_reserve(t, len + 1) = ' ';
+        memcpy(t->buf + t->len + 1, number, len);
+        t->len += len + 1;
+    }
+    *text_reserve(t, 1) = '\n';
+    t->len++;
+}
+
+/* Format the rows [first, last) of the text output and of the gradsq text output */
+void *format_text_rows(void *arg) {
+    TEXTBATCH *tb = (TEXTBATCH *)arg;
+    long long a;
+    real *word_row, *context_row;
+    char *row_buf = malloc(sizeof(real) * 2 * (vector_size + 1));
+    
+    tb->text.len = tb->gradsq_text.len = 0;
+    for(a = tb->first; a < tb->last; a++) {
+        if(a < vocab_size) {
+            word_row = W + a * (vector_size + 1);
+            context_row = W + (vocab_size + a) * (vector_size + 1);
+        }
+        else {
+            word_row = tb->unk_row;
+            context_row = tb->unk_row + vector_size + 1;
+        }
+        if(model == 0) { // Save all parameters (including bias)
+            memcpy(row_buf, word_row, sizeof(real) * (vector_size + 1));
+            memcpy(row_buf + sizeof(real) * (vector_size + 1), context_row, sizeof(real) * (vector_size + 1));
+            text_row(&tb->text, tb->words[a], (real *)row_buf, 2 * (vector_size + 1), NULL);
+        }
+        if(model == 1) text_row(&tb->text, tb->words[a], word_row, vector_size, NULL); // Save only "word" vectors (without bias)
+        if(model == 2) text_row(&tb->text, tb->words[a], word_row, vector_size, context_row); // Save "word + context word" vectors (without bias)
+        if(save_gradsq > 0 && a < vocab_size) { // Save gradsq
+            memcpy(row_buf, gradsq + a * (vector_size + 1), sizeof(real) * (vector_size + 1));
+            memcpy(row_buf + sizeof(real) * (vector_size + 1), gradsq + (vocab_size + a) * (vector_size + 1), sizeof(real) * (vector_size + 1));
+            text_row(&tb->gradsq_text, tb->words[a], (real *)row_buf, 2 * (vector_size + 1), NULL);
+        }
+    }
+    free(row_buf);
+    return NULL;
+}
+
+/* Pad the file with zeros up to a multiple of align */
+void pad_to(FILE *fout, long long *pos, long long align) {
+    for(; *pos % align != 0; (*pos)++) fputc(0, fout);
+}
+
+/* Write the parameters of the chosen model as an indexed, mappable .emb file (see embfile.h) */
+int write_emb(char **words, long long num_rows, real *unk_row) {
+    char output_file[MAX_STRING_LENGTH];
+    long long a, b, pos, string_bytes = 0;
+    unsigned long long slot, offset;
+    unsigned int *index;
+    real *word_row, *context_row, *values;
+    void *row_buf;
+    EMBHDR h;
+    FILE *fout;
+    
+    sprintf(output_file,"%s.emb",save_W_file);
+    fout = fopen(output_file,"wb");
+    if(fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",output_file); return 1;}
+    memset(&h, 0, sizeof(h));
+    strcpy(h.magic, "GLVEMB1");
+    h.dtype = emb_dtype;
+    h.model = model;
+    h.rows = num_rows;
+    h.vector_size = vector_size;
+    h.dim = (model == 0) ? 2 * (vector_size + 1) : vector_size;
+    for(a = 0; a < num_rows; a++) string_bytes += strlen(words[a]) + 1;
+    h.matrix_offset = (sizeof(EMBHDR) + EMB_ALIGN - 1) / EMB_ALIGN * EMB_ALIGN;
+    h.strings_offset = (h.matrix_offset + num_rows * h.dim * ((emb_dtype == EMB_DTYPE_FLOAT32) ? 4 : 8) + 7) / 8 * 8;
+    h.index_offset = (h.strings_offset + (num_rows + 1) * sizeof(unsigned long long) + string_bytes + 7) / 8 * 8;
+    for(h.index_slots = 1; h.index_slots < 2 * num_rows; h.index_slots *= 2); // At most half full
+    fwrite(&h, sizeof(EMBHDR), 1, fout);
+    pos = sizeof(EMBHDR);
+    pad_to(fout, &pos, EMB_ALIGN);
+    
+    // Matrix
+    values = (real *) malloc(sizeof(real) * h.dim);
+    row_buf = malloc(8 * h.dim);
+    for(a = 0; a < num_rows; a++) {
+        word_row = (a < vocab_size) ? W + a * (vector_size + 1) : unk_row;
+        context_row = (a < vocab_size) ? W + (vocab_size + a) * (vector_size + 1) : unk_row + vector_size + 1;
+        if(model == 0) for(b = 0; b < vector_size + 1; b++) {values[b] = word_row[b]; values[vector_size + 1 + b] = context_row[b];}
+        if(model == 1) for(b = 0; b < vector_size; b++) values[b] = word_row[b];
+        if(model == 2) for(b = 0; b < vector_size; b++) values[b] = word_row[b] + context_row[b];
+        if(emb_dtype == EMB_DTYPE_FLOAT32) for(b = 0; b < h.dim; b++) ((float *)row_buf)[b] = values[b];
+        else for(b = 0; b < h.dim; b++) ((double *)row_buf)[b] = values[b];
+        pos += fwrite(row_buf, (emb_dtype == EMB_DTYPE_FLOAT32) ? 4 : 8, h.dim, fout) * ((emb_dtype == EMB_DTYPE_FLOAT32) ? 4 : 8);
+    }
+    free(values);
+    free(row_buf);
+    pad_to(fout, &pos, 8);
+    
+    // String table
+    for(a = 0, offset = 0; a <= num_rows; a++) {
+        fwrite(&offset, sizeof(offset), 1, fout);
+        if(a < num_rows) offset += strlen(words[a]) + 1;
+    }
+    for(a = 0; a < num_rows; a++) fwrite(words[a], 1, strlen(words[a]) + 1, fout);
+    pos += (num_rows + 1) * sizeof(unsigned long long) + string_bytes;
+    pad_to(fout, &pos, 8);
+    
+    // Hash index; the first of two equal words wins
+    index = (unsigned int *) calloc(h.index_slots, sizeof(unsigned int));
+    for(a = 0; a < num_rows; a++) {
+        for(slot = embHash(words[a]) & (h.index_slots - 1); index[slot] != 0; slot = (slot + 1) & (h.index_slots - 1))
+            if(strcmp(words[index[slot] - 1], words[a]) == 0) break;
+        if(index[slot] == 0) index[slot] = a + 1;
+    }
+    fwrite(index, sizeof(unsigned int), h.index_slots, fout);
+    free(index);
+    if(fclose(fout) != 0) {fprintf(stderr, "Error writing file %s.\n",output_file); return 1;}
+    return 0;
 }
 
 /* Save params to file */
 int save_params() {
-    long long a, b;
-    char format[20];
+    long long a, b, num_rows;
+    char **words;
+    real *unk_row = NULL;
     char output_file[MAX_STRING_LENGTH], output_file_gsq[MAX_STRING_LENGTH];
-    char *word = malloc(sizeof(char) * MAX_STRING_LENGTH);
-    FILE *fid, *fout, *fgs;
+    FILE *fout, *fgs;
     
     if(use_binary > 0) { // Save parameters in binary file
         sprintf(output_file,"%s.bin",save_W_file);
         fout = fopen(output_file,"wb");
         if(fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_W_file); return 1;}
-        for(a = 0; a < 2 * (long long)vocab_size * (vector_size + 1); a++) fwrite(&W[a], sizeof(real), 1,fout);
+        writeReals(W, 2 * (long long)vocab_size * (vector_size + 1), fout);
         fclose(fout);
         if(save_gradsq > 0) {
             sprintf(output_file_gsq,"%s.bin",save_gradsq_file);
             fgs = fopen(output_file_gsq,"wb");
             if(fgs == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_gradsq_file); return 1;}
-            for(a = 0; a < 2 * (long long)vocab_size * (vector_size + 1); a++) fwrite(&gradsq[a], sizeof(real), 1,fgs);
+            writeReals(gradsq, 2 * (long long)vocab_size * (vector_size + 1), fgs);
             fclose(fgs);
         }
     }
+    if(use_binary == 1 && !save_emb) return 0;
+    
+    // Words and <unk>, for the text and .emb outputs
+    {
+        // input vocab cannot contain special <unk> keyword
+        if(vocabRank(vocab, "<unk>") != 0) {fprintf(stderr, "The vocabulary contains the special word <unk>.\n"); return 1;}
+        words = (char **) malloc(sizeof(char *) * (vocab_size + 1));
+        memcpy(words, vocab->words, sizeof(char *) * vocab_size);
+        num_rows = vocab_size;
+
+        if (use_unk_vec) {
+            real* unk_vec = (real*)calloc(2 * (vector_size + 1), sizeof(real));
+            real* unk_context = unk_vec + vector_size + 1;
+
+            int num_rare_words = vocab_size < 100 ? vocab_size : 100;
+
+            for(a = vocab_size - num_rare_words; a < vocab_size; a++) {
+                for(b = 0; b < (vector_size + 1); b++) {
+                    unk_vec[b] += W[a * (vector_size + 1) + b] / num_rare_words;
+                    unk_context[b] += W[(vocab_size + a) * (vector_size + 1) + b] / num_rare_words;
+                }
+            }
+            unk_row = unk_vec; // Written as one more row after the vocabulary, without gradsq
+            words[num_rows++] = "<unk>";
+        }
+    }
+    
     if(use_binary != 1) { // Save parameters in text file
+        long long first, rows_per_batch = 4096;
+        pthread_t *pt;
+        TEXTBATCH *batches;
+        
         sprintf(output_file,"%s.txt",save_W_file);
         if(save_gradsq > 0) {
             sprintf(output_file_gsq,"%s.txt",save_gradsq_file);
@@ -330,92 +1145,411 @@ int save_params() {
         }
         fout = fopen(output_file,"wb");
         if(fout == NULL) {fprintf(stderr, "Unable to open file %s.\n",save_W_file); return 1;}
-        fid = fopen(vocab_file, "r");
-        sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-        if(fid == NULL) {fprintf(stderr, "Unable to open file %s.\n",vocab_file); return 1;}
-        for(a = 0; a < vocab_size; a++) {
-            if(fscanf(fid,format,word) == 0) return 1;
-            // input vocab cannot contain special <unk> keyword
-            if(strcmp(word, "<unk>") == 0) return 1;
-            fprintf(fout, "%s",word);
-            if(model == 0) { // Save all parameters (including bias)
-                for(b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b]);
-                for(b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", W[(vocab_size + a) * (vector_size + 1) + b]);
+
+        // Rows are formatted in parallel, a batch of consecutive rows per thread, and written out in order
+        pt = (pthread_t *) malloc(sizeof(pthread_t) * num_threads);
+        batches = (TEXTBATCH *) calloc(num_threads, sizeof(TEXTBATCH));
+        for(a = 0; a < num_threads; a++) {
+            batches[a].words = words;
+            batches[a].unk_row = unk_row;
+        }
+        for(first = 0; first < num_rows; first += rows_per_batch * num_threads) {
+            for(a = 0; a < num_threads; a++) {
+                batches[a].first = first + a * rows_per_batch;
+                batches[a].last = batches[a].first + rows_per_batch;
+                if(batches[a].first > num_rows) batches[a].first = num_rows;
+                if(batches[a].last > num_rows) batches[a].last = num_rows;
+                pthread_create(&pt[a], NULL, format_text_rows, (void *)&batches[a]);
             }
-            if(model == 1) // Save only "word" vectors (without bias)
-                for(b = 0; b < vector_size; b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b]);
-            if(model == 2) // Save "word + context word" vectors (without bias)
-                for(b = 0; b < vector_size; b++) fprintf(fout," %lf", W[a * (vector_size + 1) + b] + W[(vocab_size + a) * (vector_size + 1) + b]);
-            fprintf(fout,"\n");
-            if(save_gradsq > 0) { // Save gradsq
-                fprintf(fgs, "%s",word);
-                for(b = 0; b < (vector_size + 1); b++) fprintf(fgs," %lf", gradsq[a * (vector_size + 1) + b]);
-                for(b = 0; b < (vector_size + 1); b++) fprintf(fgs," %lf", gradsq[(vocab_size + a) * (vector_size + 1) + b]);
-                fprintf(fgs,"\n");
+            for(a = 0; a < num_threads; a++) {
+                pthread_join(pt[a], NULL);
+                fwrite(batches[a].text.buf, 1, batches[a].text.len, fout);
+                if(save_gradsq > 0) fwrite(batches[a].gradsq_text.buf, 1, batches[a].gradsq_text.len, fgs);
             }
-            if(fscanf(fid,format,word) == 0) return 1; // Eat irrelevant frequency entry
         }
+        for(a = 0; a < num_threads; a++) {
+            free(batches[a].text.buf);
+            free(batches[a].gradsq_text.buf);
+        }
+        free(batches);
+        free(pt);
+        fclose(fout);
+        if(save_gradsq > 0) fclose(fgs);
+    }
+    if(save_emb && write_emb(words, num_rows, unk_row) != 0) return 1;
+    free(words);
+    free(unk_row);
+    return 0;
+}
 
-        if (use_unk_vec) {
-            real* unk_vec = (real*)calloc((vector_size + 1), sizeof(real));
-            real* unk_context = (real*)calloc((vector_size + 1), sizeof(real));
-            word = "<unk>";
+/* Write a snapshot to a temporary file and move it over the previous checkpoint, which is only replaced once the new one is on disk */
+void *write_checkpoint(void *snapshot) {
+    char tmp_file[MAX_STRING_LENGTH + 5], dir[MAX_STRING_LENGTH + 1], *slash;
+    FILE *fout;
+    int fd, ok;
+    sprintf(tmp_file, "%s.tmp", checkpoint_file);
+    fout = fopen(tmp_file, "wb");
+    if(fout == NULL) {fprintf(stderr, "Unable to open file %s.\n", tmp_file); return NULL;}
+    ok = fwrite(snapshot, 1, checkpoint_bytes, fout) == checkpoint_bytes && fflush(fout) == 0 && fsync(fileno(fout)) == 0;
+    if(fclose(fout) != 0 || !ok) {
+        fprintf(stderr, "Unable to write checkpoint %s.\n", tmp_file);
+        remove(tmp_file);
+        return NULL;
+    }
+    if(rename(tmp_file, checkpoint_file) != 0) {fprintf(stderr, "Unable to move checkpoint to %s.\n", checkpoint_file); return NULL;}
+    strcpy(dir, checkpoint_file); // The rename itself is only durable once the directory is synced
+    if((slash = strrchr(dir, '/')) == NULL) strcpy(dir, ".");
+    else if(slash == dir) slash[1] = '\0';
+    else *slash = '\0';
+    if((fd = open(dir, O_RDONLY)) >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    return NULL;
+}
 
-            int num_rare_words = vocab_size < 100 ? vocab_size : 100;
+/* Wait for the background checkpoint write, if any */
+void finish_checkpoint() {
+    if(!checkpoint_pending) return;
+    pthread_join(checkpoint_thread, NULL);
+    checkpoint_pending = 0;
+}
 
-            for(a = vocab_size - num_rare_words; a < vocab_size; a++) {
-                for(b = 0; b < (vector_size + 1); b++) {
-                    unk_vec[b] += W[a * (vector_size + 1) + b] / num_rare_words;
-                    unk_context[b] += W[(vocab_size + a) * (vector_size + 1) + b] / num_rare_words;
-                }
-            }
+/* Snapshot the parameters after iteration iter (threads must be idle) and write them out in the background */
+int start_checkpoint(int iter) {
+    CKPTHDR *h;
+    int m;
+    long long n = 2 * vocab_size * (vector_size + 1);
+    finish_checkpoint();
+    if(checkpoint_snapshot == NULL) {
+        checkpoint_bytes = sizeof(CKPTHDR) + 2 * n * sizeof(real) * num_models;
+        checkpoint_snapshot = malloc(checkpoint_bytes);
+        if(checkpoint_snapshot == NULL) {fprintf(stderr, "Error allocating memory for checkpoint\n"); return 1;}
+    }
+    h = (CKPTHDR *)checkpoint_snapshot;
+    memset(h, 0, sizeof(CKPTHDR));
+    memcpy(h->magic, "GLVCKPT1", 8);
+    h->real_size = sizeof(real);
+    h->vector_size = vector_size;
+    h->vocab_size = vocab_size;
+    h->num_lines = num_lines;
+    h->iter = iter;
+    h->num_models = (num_models > 1) ? num_models : 0;
+    h->eta = eta;
+    h->alpha = alpha;
+    h->x_max = x_max;
+    h->forcing_hash = forcing_hash;
+    for(m = 0; m < num_models; m++) {
+        memcpy(checkpoint_snapshot + sizeof(CKPTHDR) + 2 * m * n * sizeof(real), models[m].W, n * sizeof(real));
+        memcpy(checkpoint_snapshot + sizeof(CKPTHDR) + (2 * m + 1) * n * sizeof(real), models[m].gradsq, n * sizeof(real));
+    }
+    if(pthread_create(&checkpoint_thread, NULL, write_checkpoint, (void *)checkpoint_snapshot) == 0) checkpoint_pending = 1;
+    else write_checkpoint((void *)checkpoint_snapshot);
+    if(verbose > 1) fprintf(stderr, "Checkpoint after iteration %d written to %s.\n", iter, checkpoint_file);
+    return 0;
+}
 
-            fprintf(fout, "%s",word);
-            if(model == 0) { // Save all parameters (including bias)
-                for(b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", unk_vec[b]);
-                for(b = 0; b < (vector_size + 1); b++) fprintf(fout," %lf", unk_context[b]);
-            }
-            if(model == 1) // Save only "word" vectors (without bias)
-                for(b = 0; b < vector_size; b++) fprintf(fout," %lf", unk_vec[b]);
-            if(model == 2) // Save "word + context word" vectors (without bias)
-                for(b = 0; b < vector_size; b++) fprintf(fout," %lf", unk_vec[b] + unk_context[b]);
-            fprintf(fout,"\n");
+/* Restore W, gradsq and the iteration counter from checkpoint_file, refusing checkpoints of a different setup */
+int load_checkpoint() {
+    CKPTHDR h;
+    FILE *fin;
+    int m;
+    long long n = 2 * vocab_size * (vector_size + 1);
+    fin = fopen(checkpoint_file, "rb");
+    if(fin == NULL) {fprintf(stderr, "Unable to open checkpoint %s.\n", checkpoint_file); return 1;}
+    if(fread(&h, sizeof(CKPTHDR), 1, fin) != 1 || memcmp(h.magic, "GLVCKPT1", 8) != 0) {fprintf(stderr, "Incompatible file: %s.\n", checkpoint_file); fclose(fin); return 1;}
+    if(h.real_size != sizeof(real) || h.vector_size != vector_size || h.vocab_size != vocab_size || h.num_lines != num_lines || h.num_models != ((num_models > 1) ? num_models : 0)) {
+        fprintf(stderr, "Checkpoint %s was written for different data, vector size, precision or number of models.\n", checkpoint_file); fclose(fin); return 1;
+    }
+    if(h.eta != (double)eta || h.alpha != (double)alpha || h.x_max != (double)x_max || h.forcing_hash != forcing_hash) {
+        fprintf(stderr, "Checkpoint %s was written with different hyperparameters or forcing parameters.\n", checkpoint_file); fclose(fin); return 1;
+    }
+    for(m = 0; m < num_models; m++)
+        if(fread(models[m].W, sizeof(real), n, fin) != n || fread(models[m].gradsq, sizeof(real), n, fin) != n) {fprintf(stderr, "Truncated checkpoint %s.\n", checkpoint_file); fclose(fin); return 1;}
+    fclose(fin);
+    start_iter = h.iter;
+    if(verbose > 0) fprintf(stderr, "Resuming from %s after iteration %d.\n", checkpoint_file, start_iter);
+    return 0;
+}
+
+/* Find the row of every word of the vocabulary in the vocabulary of the trained model, and freeze the rows found unless update_old */
+int map_trained_vocab() {
+    long long a, num_found = 0;
+    int w;
+    VOCABTABLE *trained_vocab;
+
+    trained_row = (long long *) malloc(sizeof(long long) * (vocab_size + 2));
+    if(extend_vocab_file == NULL) { // Warm start: same vocabulary, every row is trained
+        trained_vocab_size = vocab_size;
+        for(a = 0; a < vocab_size + 2; a++) trained_row[a] = a - 1;
+        if(verbose > 0) fprintf(stderr, "Fine-tuning %s for %d iterations with eta %lf.\n", trained_vectors_file, num_iter, eta);
+        return 0;
+    }
+    trained_vocab = loadVocab(extend_vocab_file);
+    if(trained_vocab == NULL) {fprintf(stderr, "Unable to open vocab file %s.\n",extend_vocab_file); return 1;}
+    trained_vocab_size = trained_vocab->size;
+    for(a = 0; a < vocab_size + 2; a++) trained_row[a] = -1;
+    for(a = 0; a < trained_vocab_size; a++) {
+        w = vocabRank(vocab, trained_vocab->words[a]);
+        if(w > 0 && trained_row[w] < 0) {trained_row[w] = a; num_found++;}
+    }
+    freeVocab(trained_vocab);
+
+    if(!update_old) {
+        frozen_word = (char *) calloc(vocab_size + 2, sizeof(char));
+        for(a = 1; a <= vocab_size; a++) frozen_word[a] = trained_row[a] >= 0;
+    }
+    if(verbose > 0) fprintf(stderr, "Extending a model of %lld words: %lld of %lld words are new%s.\n", trained_vocab_size, vocab_size - num_found, vocab_size, update_old ? "" : ", the others are kept fixed");
+    return 0;
+}
+
+/* Copy the rows (and squared gradients) of the words of the trained model into W and gradsq; when extending, the rows of new words are random */
+int load_trained_rows() {
+    long long a, b, w, row_size = vector_size + 1;
+    long long expected = 2 * trained_vocab_size * row_size * (long long)sizeof(double); // The files hold doubles
+    long long *new_word;
+    real *row;
+    FILE *fv, *fg;
+
+    fv = fopen(trained_vectors_file, "rb");
+    if(fv == NULL) {fprintf(stderr, "Unable to open file %s.\n", trained_vectors_file); return 1;}
+    fg = fopen(trained_gradsq_file, "rb");
+    if(fg == NULL) {fprintf(stderr, "Unable to open file %s.\n", trained_gradsq_file); fclose(fv); return 1;}
+    fseeko(fv, 0, SEEK_END);
+    fseeko(fg, 0, SEEK_END);
+    if(ftello(fv) != expected || ftello(fg) != expected) {
+        fprintf(stderr, "%s and %s do not hold a model of %lld words with vector size %d.\n", trained_vectors_file, trained_gradsq_file, trained_vocab_size, vector_size);
+        fclose(fv); fclose(fg); return 1;
+    }
+    rewind(fv);
+    rewind(fg);
 
-            free(unk_vec);
-            free(unk_context);
+    if(extend_vocab_file != NULL) {
+        srand(seed);
+        for (b = 0; b < row_size; b++) for (a = 0; a < 2 * vocab_size; a++) W[a * row_size + b] = (rand() / (real)RAND_MAX - 0.5) / row_size;
+        for (a = 0; a < 2 * vocab_size * row_size; a++) gradsq[a] = 1.0;
+    }
+
+    // Word rows, then context rows, in the order of the trained vocabulary
+    new_word = (long long *) calloc(trained_vocab_size, sizeof(long long));
+    for(w = 1; w <= vocab_size; w++) if(trained_row[w] >= 0) new_word[trained_row[w]] = w;
+    row = (real *) malloc(sizeof(real) * 2 * row_size);
+    for(a = 0; a < 2 * trained_vocab_size; a++) {
+        if(readReals(row, row_size, fv) != row_size || readReals(row + row_size, row_size, fg) != row_size) {
+            fprintf(stderr, "Unable to read %s and %s.\n", trained_vectors_file, trained_gradsq_file); fclose(fv); fclose(fg); return 1;
         }
+        w = new_word[a % trained_vocab_size];
+        if(w == 0) continue; // Word dropped from the vocabulary
+        b = ((w - 1) + (a < trained_vocab_size ? 0 : vocab_size)) * row_size;
+        memcpy(W + b, row, sizeof(real) * row_size);
+        memcpy(gradsq + b, row + row_size, sizeof(real) * row_size);
+    }
+    fclose(fv);
+    fclose(fg);
+    free(row);
+    free(new_word);
+    return 0;
+}
 
-        fclose(fid);
-        fclose(fout);
-        if(save_gradsq > 0) fclose(fgs);
+/* Make the whole cooccurrence file available in memory, either mapped read-only or loaded into one buffer */
+int map_cooccurrences(long long file_size) {
+    int fd;
+    long long phys_bytes = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    void *data;
+
+    rec_mapping_size = (size_t)file_size;
+    if(rec_mapping_size == 0) return 0;
+    if(in_memory == 2 && file_size > 0.9 * phys_bytes) {
+        if(verbose > 0) fprintf(stderr, "Cooccurrence file does not fit in memory, mapping it instead.\n");
+        in_memory = 1;
+    }
+    fd = open(input_file, O_RDONLY);
+    if(fd < 0) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
+    if(in_memory == 1) {
+        data = mmap(NULL, rec_mapping_size, PROT_READ, MAP_SHARED, fd, 0);
+        if(data == MAP_FAILED) {fprintf(stderr,"Unable to map cooccurrence file %s.\n",input_file); close(fd); return 1;}
+        madvise(data, rec_mapping_size, (file_size < 0.9 * phys_bytes) ? MADV_WILLNEED : MADV_SEQUENTIAL);
+    }
+    else {
+        size_t done = 0;
+        ssize_t got;
+        data = malloc(rec_mapping_size);
+        if(data == NULL) {fprintf(stderr, "Error allocating memory for cooccurrence data\n"); close(fd); return 1;}
+        while(done < rec_mapping_size) {
+            got = read(fd, (char *)data + done, (rec_mapping_size - done < (1 << 26)) ? rec_mapping_size - done : (1 << 26));
+            if(got <= 0) {fprintf(stderr,"Unable to read cooccurrence file %s.\n",input_file); close(fd); return 1;}
+            done += got;
+        }
     }
+    close(fd);
+    rec_mapping = data;
+    if(verbose > 1) fprintf(stderr, "%s %lld bytes of cooccurrence data.\n", (in_memory == 1) ? "Mapped" : "Loaded", file_size);
+    return 0;
+}
+
+/* Release the in-memory cooccurrence data */
+void unmap_cooccurrences() {
+    if(rec_mapping == NULL) return;
+    if(in_memory == 1) munmap(rec_mapping, rec_mapping_size);
+    else free(rec_mapping);
+    rec_mapping = NULL;
+}
+
+/* Find the blocks of a RECFMT_BLOCK file from their headers */
+int index_blocks(FILE *fin, long long file_size) {
+    long long offset = sizeof(RECHDR), capacity = 1024;
+    RECBLOCKHDR h;
+
+    block_offsets = malloc(sizeof(long long) * (capacity + 1));
+    block_starts = malloc(sizeof(long long) * (capacity + 1));
+    block_offsets[0] = offset;
+    block_starts[0] = 0;
+    num_blocks = 0;
+    while(offset + (long long)sizeof(RECBLOCKHDR) <= file_size) {
+        fseeko(fin, offset, SEEK_SET);
+        if(fread(&h, sizeof(RECBLOCKHDR), 1, fin) != 1 || h.records < 0 || h.bytes < 0 || offset + (long long)sizeof(RECBLOCKHDR) + h.bytes > file_size) {
+            fprintf(stderr, "Corrupt block at offset %lld of %s.\n", offset, input_file);
+            return 1;
+        }
+        if(num_blocks == capacity) {
+            capacity *= 2;
+            block_offsets = realloc(block_offsets, sizeof(long long) * (capacity + 1));
+            block_starts = realloc(block_starts, sizeof(long long) * (capacity + 1));
+        }
+        offset += sizeof(RECBLOCKHDR) + h.bytes;
+        num_blocks++;
+        block_offsets[num_blocks] = offset;
+        block_starts[num_blocks] = block_starts[num_blocks - 1] + h.records;
+        if(h.records > max_block_records) max_block_records = h.records;
+        if(h.bytes > max_block_bytes) max_block_bytes = h.bytes;
+    }
+    if(verbose > 1) fprintf(stderr, "Indexed %lld blocks of compressed records.\n", num_blocks);
+    return 0;
+}
+
+/* Keep only the records that involve a word new to the trained model, in one buffer that takes the place of the input file */
+int filter_records() {
+    long long a, c, n, num_chunks, kept = 0, capacity = 1 << 20;
+    long long keep_size = (record_format == RECFMT_BLOCK) ? sizeof(CRECF) : record_size;
+    const char *recs, *r;
+    char *kept_recs, *chunk_buf = NULL;
+    CRECF *decoded = NULL;
+    FILE *fin = NULL;
+    THREADSTATS io;
+
+    num_chunks = (record_format == RECFMT_BLOCK) ? num_blocks : (num_lines + chunk_size - 1) / chunk_size;
+    if(rec_mapping == NULL) {
+        fin = fopen(input_file, "rb");
+        if(fin == NULL) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
+        chunk_buf = (char *) malloc((record_format == RECFMT_BLOCK) ? max_block_bytes : record_size * chunk_size);
+    }
+    if(record_format == RECFMT_BLOCK) decoded = (CRECF *) malloc(sizeof(CRECF) * max_block_records);
+    kept_recs = (char *) malloc(keep_size * capacity);
+    for(c = 0; c < num_chunks; c++) {
+        recs = load_chunk(c, &n, fin, chunk_buf, decoded, &io);
+        for(a = 0, r = recs; a < n; a++, r += keep_size) {
+            if(trained_row[((const int *)r)[0]] >= 0 && trained_row[((const int *)r)[1]] >= 0) continue; // All record types start with word1 and word2
+            if(kept == capacity) {
+                capacity *= 2;
+                kept_recs = (char *) realloc(kept_recs, keep_size * capacity);
+                if(kept_recs == NULL) {fprintf(stderr, "Error allocating memory for the records of new words\n"); return 1;}
+            }
+            memcpy(kept_recs + keep_size * kept++, r, keep_size);
+        }
+    }
+    if(fin != NULL) fclose(fin);
+    free(chunk_buf);
+    free(decoded);
+    unmap_cooccurrences();
+    if(verbose > 0) fprintf(stderr, "Kept %lld of %lld records, those involving new words.\n", kept, num_lines);
+    if(kept == 0) {fprintf(stderr, "No record involves a new word.\n"); return 1;}
+
+    // From here on the records are held in memory, decoded
+    if(record_format == RECFMT_BLOCK) {
+        record_format = RECFMT_COMPACT;
+        record_size = sizeof(CRECF);
+        num_blocks = 0;
+    }
+    rec_mapping = kept_recs;
+    rec_mapping_size = keep_size * kept;
+    in_memory = 2;
+    record_offset = 0;
+    num_lines = kept;
     return 0;
 }
 
 /* Train model */
 int train_glove() {
     long long a, file_size;
-    int b;
+    int b, m;
     FILE *fin;
-    real total_cost = 0;
+    double total_cost = 0, iter_start;
+    time_t last_checkpoint;
+    RECHDR header;
     fprintf(stderr, "TRAINING MODEL\n");
     
     fin = fopen(input_file, "rb");
     if(fin == NULL) {fprintf(stderr,"Unable to open cooccurrence file %s.\n",input_file); return 1;}
+    record_format = readRecordHeader(fin, &header);
+    if(record_format < 0) record_format = RECFMT_CREC; // Shorter than a header: no records at all
+    record_size = recordSize(record_format);
+    if(record_size == 0) {fprintf(stderr,"Unknown record format %d in %s.\n", record_format, input_file); fclose(fin); return 1;}
+    record_offset = (record_format == RECFMT_CREC) ? 0 : sizeof(RECHDR);
+    if(record_format == RECFMT_TRAIN) { // log X and f(X) are baked into the records
+        if(verbose > 0 && (header.x_max != (float)x_max || header.alpha != (float)alpha)) fprintf(stderr, "Using x_max %g and alpha %g of the precomputed records.\n", header.x_max, header.alpha);
+        x_max = header.x_max;
+        alpha = header.alpha;
+    }
     fseeko(fin, 0, SEEK_END);
     file_size = ftello(fin);
-    num_lines = file_size/(sizeof(CREC)); // Assuming the file isn't corrupt and consists only of CREC's
+    if(record_format == RECFMT_BLOCK) {
+        if(index_blocks(fin, file_size) != 0) {fclose(fin); return 1;}
+        num_lines = block_starts[num_blocks];
+        file_size = block_offsets[num_blocks];
+    }
+    else {
+        num_lines = (file_size - record_offset) / record_size; // Assuming the file isn't corrupt and consists only of records
+        file_size = record_offset + num_lines * record_size;
+    }
     fclose(fin);
     fprintf(stderr,"Read %lld lines.\n", num_lines);
+    if(in_memory > 0 && map_cooccurrences(file_size) != 0) return 1;
+    if((warm_start || extend_vocab_file != NULL) && map_trained_vocab() != 0) return 1;
+    if(extend_vocab_file != NULL && filter_records() != 0) return 1;
+    if(schedule == 1) {
+        if(block_grid < 1) block_grid = 4 * num_threads;
+        if(block_grid > vocab_size) block_grid = vocab_size;
+        step_next = (int *) malloc(sizeof(int) * block_grid);
+        if(bucket_records() != 0) return 1;
+        unmap_cooccurrences(); // The blocks hold their own copy
+    }
+    if(pin_threads) assign_thread_cpus();
     if(verbose > 1) fprintf(stderr,"Initializing parameters...");
     initialize_parameters();
     if(verbose > 1) fprintf(stderr,"done.\n");
+    if(verbose > 0 && (huge_pages > 0 || numa_interleave)) {
+        report_placement(W, 2 * vocab_size * (vector_size + 1) * sizeof(real), "W");
+        report_placement(gradsq, 2 * vocab_size * (vector_size + 1) * sizeof(real), "gradsq");
+    }
     if(verbose > 0) fprintf(stderr,"vector size: %d\n", vector_size);
     if(verbose > 0) fprintf(stderr,"vocab size: %lld\n", vocab_size);
     if(verbose > 0) fprintf(stderr,"x_max: %lf\n", x_max);
     if(verbose > 0) fprintf(stderr,"alpha: %lf\n", alpha);
+    const char *kernel = adagradStepInit(simd_isa);
+    if(verbose > 0) fprintf(stderr,"update kernel: %s\n", kernel);
+    if(verbose > 0 && forcing_mode == 1) fprintf(stderr,"forcing: once per epoch\n");
+    if(verbose > 0 && schedule == 1) fprintf(stderr,"schedule: %d x %d blocks%s\n", block_grid, block_grid, deterministic ? ", deterministic" : "");
     pthread_t *pt = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
-    lines_per_thread = (long long *) malloc(num_threads * sizeof(long long));
+    if(forcing_mode == 1) {
+        forcing_weights = (double *) calloc(num_threads * 2 * (vocab_size + 1), sizeof(double));
+        if(forcing_weights == NULL) {fprintf(stderr, "Error allocating memory for the forcing weights\n"); return 1;}
+    }
+    long long num_chunks = (record_format == RECFMT_BLOCK) ? num_blocks : (num_lines + chunk_size - 1) / chunk_size;
+    a = posix_memalign((void **)&chunk_queues, 64, num_threads * sizeof(CHUNKQ));
+    if (chunk_queues == NULL) {
+        fprintf(stderr, "Error allocating memory for chunk queues\n");
+        return 1;
+    }
     
     // Print information on forced dims to console
     if(!forcing_enabled) fprintf(stderr, "Forcing disabled.\n");
@@ -434,43 +1568,292 @@ int train_glove() {
         fprintf(stderr, "\n");
     }
 
-    // Lock-free asynchronous SGD
-    for(b = 0; b < num_iter; b++) {
+    // Asynchronous SGD on a persistent pool of threads, lock-free (Hogwild) or on disjoint blocks; each epoch starts and ends at a barrier
+    pthread_barrier_init(&epoch_start, NULL, num_threads + 1);
+    pthread_barrier_init(&epoch_end, NULL, num_threads + 1);
+    pthread_barrier_init(&step_barrier, NULL, num_threads);
+    for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, glove_thread, (void *)a);
+    last_checkpoint = time(NULL);
+    if(metrics_file != NULL) {
+        fmetrics = fopen(metrics_file, (start_iter > 0) ? "a" : "w");
+        if(fmetrics == NULL) {fprintf(stderr, "Unable to open file %s.\n", metrics_file); return 1;}
+    }
+    for(b = start_iter; b < num_iter; b++) {
         total_cost = 0;
-        for (a = 0; a < num_threads - 1; a++) lines_per_thread[a] = num_lines / num_threads;
-        lines_per_thread[a] = num_lines / num_threads + num_lines % num_threads;
-        for (a = 0; a < num_threads; a++) pthread_create(&pt[a], NULL, glove_thread, (void *)a);
-        for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
-        for (a = 0; a < num_threads; a++) total_cost += cost[a];
-        fprintf(stderr,"iter: %03d, cost: %lf\n", b+1, total_cost/num_lines);
+        iter_start = clock_seconds(CLOCK_MONOTONIC);
+        if(step_next != NULL) {
+            for (a = 0; a < block_grid; a++) step_next[a] = 0;
+            epoch_step = (b * 7919LL) % block_grid; // Vary the order of the diagonals between epochs
+        }
+        for (a = 0; a < num_threads; a++) { // Each thread starts on its own contiguous range of chunks
+            chunk_queues[a].next = num_chunks * a / num_threads;
+            chunk_queues[a].end = num_chunks * (a + 1) / num_threads;
+        }
+        pthread_barrier_wait(&epoch_start);
+        pthread_barrier_wait(&epoch_end);
+        if(forcing_mode == 1) apply_lazy_forcing();
+        fprintf(stderr,"iter: %03d, cost:", b+1);
+        for (m = 0; m < num_models; m++) {
+            total_cost = 0;
+            for (a = 0; a < num_threads; a++) total_cost += thread_stats[a * num_models + m].cost + thread_stats[a * num_models + m].cost_forced;
+            fprintf(stderr,"%s %lf", (m > 0) ? "," : "", total_cost/num_lines);
+        }
+        fprintf(stderr,"\n");
+        if(fmetrics != NULL) write_metrics(b + 1, clock_seconds(CLOCK_MONOTONIC) - iter_start);
+        if((checkpoint_every > 0 && (b + 1) % checkpoint_every == 0) || (checkpoint_minutes > 0 && difftime(time(NULL), last_checkpoint) >= 60 * checkpoint_minutes)) {
+            if(b + 1 < num_iter && start_checkpoint(b + 1) != 0) return 1;
+            last_checkpoint = time(NULL);
+        }
     }
+    finish_checkpoint();
+    free(checkpoint_snapshot);
+    if(fmetrics != NULL) fclose(fmetrics);
+    training_done = 1;
+    pthread_barrier_wait(&epoch_start);
+    for (a = 0; a < num_threads; a++) pthread_join(pt[a], NULL);
+    pthread_barrier_destroy(&epoch_start);
+    pthread_barrier_destroy(&epoch_end);
+    pthread_barrier_destroy(&step_barrier);
+    if(block_records != NULL) {
+        for(a = 0; a < (long long)block_grid * block_grid; a++) free(block_records[a]);
+        free(block_records);
+        free(block_counts);
+        free(step_next);
+    }
+    free(chunk_queues);
+    free(thread_cpus);
+    free(block_offsets);
+    free(block_starts);
+    free(trained_row);
+    free(frozen_word);
+    free(forcing_weights);
+    free(pt);
     fprintf(stderr, "\n");
+    unmap_cooccurrences();
 
     // Free up unused memory after training
     {
-        int j,k;
+        int j;
         if(forcing_enabled){
             free(forcedDims);
-            for (j=0; j<numForcedDims; j++){
-                free(wordIdsPerForcedDim[j]);
-                free(polaritiesPerForcedDim[j]);
-                free(kvalsPerForcedDim[j]);
-            }
+            for (j=0; j<numForcedDims; j++) free(wordIdsPerForcedDim[j]);
             free(wordIdsPerForcedDim);
-            free(polaritiesPerForcedDim);
-            free(kvalsPerForcedDim);
-            for (j=0; j<numForcedDims; j++){
-                for(k=0; k<numWordsPerForcedDim[j]; k++) free(wordStringsPerForcedDim[j][k]);
-                free(wordStringsPerForcedDim[j]);
-            }
+            for (j=0; j<numForcedDims; j++) free(wordStringsPerForcedDim[j]);
             free(wordStringsPerForcedDim);
-            free(numWordsPerForcedDim);
         }
+        for (m = 0; m < num_models; m++) {
+            select_model(m);
+            if(forcing_enabled){
+                for (j=0; j<numForcedDims; j++){
+                    free(polaritiesPerForcedDim[j]);
+                    free(kvalsPerForcedDim[j]);
+                }
+                free(polaritiesPerForcedDim);
+                free(kvalsPerForcedDim);
+            }
+            free(forceOffsets);
+            free(forceDims);
+            free(forcePols);
+            free(forceKvals);
+        }
+        free(numWordsPerForcedDim);
+    }
+
+    // Each model is saved to its own files
+    for (m = 0; m < num_models; m++) {
+        select_model(m);
+        if(save_params() != 0) return 1;
+        free_parameters(models[m].W, 2 * vocab_size * (vector_size + 1) * sizeof(real));
+        free_parameters(models[m].gradsq, 2 * vocab_size * (vector_size + 1) * sizeof(real));
+        models[m].W = models[m].gradsq = NULL;
+    }
+    return 0;
+}
+
+/* Build the per-word forcing index from the per-dim lists; entries of a word keep the order of the forced dims file */
+int build_forcing_index(){
+    int i, j, w, num_entries = 0;
+    int *cursor;
+
+    forceOffsets = (int*) calloc(vocab_size + 2, sizeof(int)); // word ids start at 1
+    if(forceOffsets == NULL) {fprintf(stderr, "Error allocating memory for the forcing index\n"); return 1;}
+    for(i=0; i<numForcedDims; i++)
+        for(j=0; j<numWordsPerForcedDim[i]; j++) forceOffsets[wordIdsPerForcedDim[i][j] + 1]++;
+    for(w=1; w<=vocab_size + 1; w++) forceOffsets[w] += forceOffsets[w-1];
+    num_entries = forceOffsets[vocab_size + 1];
+
+    forceDims = (int*) malloc(sizeof(int) * (num_entries + 1));
+    forcePols = (int*) malloc(sizeof(int) * (num_entries + 1));
+    forceKvals = (real*) malloc(sizeof(real) * (num_entries + 1));
+    cursor = (int*) malloc(sizeof(int) * (vocab_size + 1));
+    if(forceDims == NULL || forcePols == NULL || forceKvals == NULL || cursor == NULL) {fprintf(stderr, "Error allocating memory for the forcing index\n"); return 1;}
+    memcpy(cursor, forceOffsets, sizeof(int) * (vocab_size + 1));
+    for(i=0; i<numForcedDims; i++)
+        for(j=0; j<numWordsPerForcedDim[i]; j++){
+            w = wordIdsPerForcedDim[i][j];
+            forceDims[cursor[w]] = forcedDims[i];
+            forcePols[cursor[w]] = polaritiesPerForcedDim[i][j];
+            forceKvals[cursor[w]] = kvalsPerForcedDim[i][j];
+            cursor[w]++;
+        }
+    free(cursor);
+    if(verbose > 1) fprintf(stderr, "Built forcing index with %d entries.\n", num_entries);
+
+    // Checkpoints record which forcing setup they belong to
+    forcing_hash = fnv1a(forceOffsets, sizeof(int) * (vocab_size + 2), forcing_hash);
+    forcing_hash = fnv1a(forceDims, sizeof(int) * num_entries, forcing_hash);
+    forcing_hash = fnv1a(forcePols, sizeof(int) * num_entries, forcing_hash);
+    forcing_hash = fnv1a(forceKvals, sizeof(real) * num_entries, forcing_hash);
+    return 0;
+}
+
+/* Read the polarities of the forced words of the model in use from polarities_file */
+int read_polarities(){
+    FILE *fid_polarities;
+
+    size_t buffersize = 0; // updated by the getline call
+    char *buffer = 0; // allocated and adjusted as needed by getline
+    int line_length; // includes the terminating newline
+
+    int line_ind, j, k, l;
+    char* token;
+    int md;
+
+    // Polarities
+    fid_polarities = fopen(polarities_file, "r");
+    if(fid_polarities == NULL) {fprintf(stderr, "Unable to open file %s.\n", polarities_file); return 1;}
+
+    // Allocate memory and read
+    // polaritiesPerForcedDim = (int**) malloc(sizeof(int*) * numForcedDims);
+    polaritiesPerForcedDim = (int**) calloc(numForcedDims, sizeof(int*)); // initialize to NULLs
+
+    line_ind = 0;
+    while ((line_length = getline(&buffer, &buffersize, fid_polarities)) > 0){
+        if(*buffer == '#') continue;
+        if(*buffer == '\n') continue;
+        if(line_ind == numForcedDims){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+        if(strspn(buffer, "+- *") != line_length-1){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+
+        // Store the tokens
+        token = strtok(buffer, " ");
+        for(j=0; j<numWordsPerForcedDim[line_ind]; j++){
+            if((md = strspn(token, "*")) == 2){
+                if(j) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                if(line_ind) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                if(strpbrk(token+2, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                for(l=0; l<numForcedDims; l++){
+                    polaritiesPerForcedDim[l] = (int *) malloc(sizeof(int) * numWordsPerForcedDim[l]);
+                    for(k=0; k<numWordsPerForcedDim[l]; k++) {polaritiesPerForcedDim[l][k] = (*(token+2) == '+') ? 1:-1;}
+                }
+                token = strtok(NULL, " "); // should be NULL
+                do{line_length = getline(&buffer, &buffersize, fid_polarities);} while(line_length > 0 && (*buffer == '#' || *buffer == '\n')); // should be -1
+                break;
+            }
+            else if (md == 1) {
+                if(j) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                if(strpbrk(token+1, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                polaritiesPerForcedDim[line_ind] = (int *) malloc(sizeof(int) * numWordsPerForcedDim[line_ind]);
+                for(k=0; k<numWordsPerForcedDim[line_ind]; k++) {polaritiesPerForcedDim[line_ind][k] = (*(token+1) == '+') ? 1:-1;}
+                token = strtok(NULL, " "); // should be NULL
+                break;
+            }
+            else if (md == 0) {
+                if(token == NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                if(strpbrk(token, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+                if(polaritiesPerForcedDim[line_ind] == 0) {polaritiesPerForcedDim[line_ind] = (int *) malloc(sizeof(int) * numWordsPerForcedDim[line_ind]);}
+                polaritiesPerForcedDim[line_ind][j] = (*token == '+') ? 1:-1;
+                token = strtok(NULL, " ");
+            }
+            else{fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+        }
+        if(token != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+        if(md == 2 && line_length > 0){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+
+        // Next line
+        line_ind++;
+    }
+    if(line_ind < numForcedDims && md != 2) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
+    free(buffer);
+    fclose(fid_polarities);
+    return 0;
+}
+
+/* Read the k-values of the forced words of the model in use from k_vals_file */
+int read_k_vals(){
+    FILE *fid_k_vals;
+
+    size_t buffersize = 0; // updated by the getline call
+    char *buffer = 0; // allocated and adjusted as needed by getline
+    int line_length; // includes the terminating newline
+
+    int line_ind, j, k, l;
+    char* token;
+    int md;
+
+    // k-values
+    fid_k_vals = fopen(k_vals_file, "r");
+    if(fid_k_vals == NULL) {fprintf(stderr, "Unable to open file %s.\n", k_vals_file); return 1;}
+
+    // Allocate memory and read
+    // kvalsPerForcedDim = (real**) malloc(sizeof(real*) * numForcedDims);
+    kvalsPerForcedDim = (real**) calloc(numForcedDims, sizeof(real*)); // initialize to NULLs
+
+    line_ind = 0;
+    while ((line_length = getline(&buffer, &buffersize, fid_k_vals)) > 0){
+        if(*buffer == '#') continue;
+        if(*buffer == '\n') continue;
+        if(line_ind == numForcedDims){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+
+        // Store the tokens
+        token = strtok(buffer, " ");
+        for(j=0; j<numWordsPerForcedDim[line_ind]; j++){
+            if((md = strspn(token, "*")) == 2){
+                if(j) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(line_ind) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(strpbrk(token+2, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(!isdigit(*(token+2))){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;} // want to avoid disallowing 0 entirely
+                for(l=0; l<numForcedDims; l++){
+                    kvalsPerForcedDim[l] = (real *) malloc(sizeof(real) * numWordsPerForcedDim[l]);
+                    for(k=0; k<numWordsPerForcedDim[l]; k++) {kvalsPerForcedDim[l][k] = atof(token+2);}
+                }
+                token = strtok(NULL, " "); // should be NULL
+                do{line_length = getline(&buffer, &buffersize, fid_k_vals);} while(line_length > 0 && (*buffer == '#' || *buffer == '\n')); // should be -1
+                break;
+            }
+            else if (md == 1) {
+                if(j) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(strpbrk(token+1, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(!isdigit(*(token+1))){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;} // want to avoid disallowing 0 entirely
+                kvalsPerForcedDim[line_ind] = (real *) malloc(sizeof(real) * numWordsPerForcedDim[line_ind]);
+                for(k=0; k<numWordsPerForcedDim[line_ind]; k++) {kvalsPerForcedDim[line_ind][k] = atof(token+1);}
+                token = strtok(NULL, " "); // should be NULL
+                break;
+            }
+            else if (md == 0) {
+                if(token == NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(strpbrk(token, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+                if(!isdigit(*token)){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;} // want to avoid disallowing 0 entirely
+                if(kvalsPerForcedDim[line_ind] == 0) {kvalsPerForcedDim[line_ind] = (real *) malloc(sizeof(real) * numWordsPerForcedDim[line_ind]);}
+                kvalsPerForcedDim[line_ind][j] = atof(token);
+                token = strtok(NULL, " ");
+            }
+            else{fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+        }
+        if(token != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+        if(md == 2 && line_length > 0){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+
+        // Next line
+        line_ind++;
     }
-    return save_params();
+    if(line_ind < numForcedDims && md != 2) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+    free(buffer);
+    fclose(fid_k_vals);
+    return 0;
 }
 
 int get_forced_dims(){
+    int m;
+
     // Forced dimensions
     {
         FILE *fid_forced_dims;
@@ -540,24 +1923,29 @@ int get_forced_dims(){
         while ((line_length = getline(&buffer, &buffersize, fid_forced_ids)) > 0){
             if(*buffer == '#') continue;
             if(*buffer == '\n') continue;
-            if(strpbrk(buffer, ".") != NULL){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;}
             if(line_ind == numForcedDims){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;}
 
             // Get the number of tokens in the line
             num_tokens = 0;
             tmp_buffer = (char*) realloc(tmp_buffer, buffersize);
             strcpy(tmp_buffer, buffer);
-            for(token = strtok(tmp_buffer, " "); token != NULL; token = strtok(NULL, " ")) num_tokens++;
+            for(token = strtok(tmp_buffer, " \n"); token != NULL; token = strtok(NULL, " \n")) num_tokens++;
             numWordsPerForcedDim[line_ind] = num_tokens;
 
-            // Store the tokens
+            // Store the tokens: frequency ranks, or words (a word made of digits and dots is written with a leading '=')
             wordIdsPerForcedDim[line_ind] = (int *) malloc(sizeof(int) * num_tokens);
-            token = strtok(buffer, " ");
+            token = strtok(buffer, " \n");
             for(j=0; j<num_tokens; j++){
-                if(atoi(token) > vocab_size){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;}
-                if(atoi(token) <= 0){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;}
-                wordIdsPerForcedDim[line_ind][j] = atoi(token);
-                token = strtok(NULL, " ");
+                if(token[strspn(token, "0123456789")] == '\0'){
+                    if(atoi(token) > vocab_size){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;}
+                    if(atoi(token) <= 0){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;}
+                    wordIdsPerForcedDim[line_ind][j] = atoi(token);
+                }
+                else if(strchr(token, '.') != NULL && token[strspn(token, "0123456789.")] == '\0'){fprintf(stderr, "Incompatible file: %s.\n", forced_word_ids_file); return 1;} // A malformed rank such as 12.5 (the word 12.5 is written =12.5)
+                else if((wordIdsPerForcedDim[line_ind][j] = vocabRank(vocab, token + (*token == '='))) == 0){
+                    fprintf(stderr, "Forced word %s of %s is not in the vocabulary.\n", token + (*token == '='), forced_word_ids_file); return 1;
+                }
+                token = strtok(NULL, " \n");
             }
 
             // Next line
@@ -570,188 +1958,82 @@ int get_forced_dims(){
     }
 
 
-    // Polarities
+    // String forms (for ease with debugging), pointing into the vocabulary
     {
-        FILE *fid_polarities;
-
-        size_t buffersize = 0; // updated by the getline call
-        char *buffer = 0; // allocated and adjusted as needed by getline
-        int line_length; // includes the terminating newline
-
-        int line_ind, j, k, l;
-        char* token;
-        int md;
-
-        // Polarities
-        fid_polarities = fopen(polarities_file, "r");
-        if(fid_polarities == NULL) {fprintf(stderr, "Unable to open file %s.\n", polarities_file); return 1;}
-
-        // Allocate memory and read
-        // polaritiesPerForcedDim = (int**) malloc(sizeof(int*) * numForcedDims);
-        polaritiesPerForcedDim = (int**) calloc(numForcedDims, sizeof(int*)); // initialize to NULLs
-
-        line_ind = 0;
-        while ((line_length = getline(&buffer, &buffersize, fid_polarities)) > 0){
-            if(*buffer == '#') continue;
-            if(*buffer == '\n') continue;
-            if(line_ind == numForcedDims){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-            if(strspn(buffer, "+- *") != line_length-1){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-
-            // Store the tokens
-            token = strtok(buffer, " ");
-            for(j=0; j<numWordsPerForcedDim[line_ind]; j++){
-                if((md = strspn(token, "*")) == 2){
-                    if(j) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    if(line_ind) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    if(strpbrk(token+2, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    for(l=0; l<numForcedDims; l++){
-                        polaritiesPerForcedDim[l] = (int *) malloc(sizeof(int) * numWordsPerForcedDim[l]);
-                        for(k=0; k<numWordsPerForcedDim[l]; k++) {polaritiesPerForcedDim[l][k] = (*(token+2) == '+') ? 1:-1;}
-                    }
-                    token = strtok(NULL, " "); // should be NULL
-                    do{line_length = getline(&buffer, &buffersize, fid_polarities);} while(line_length > 0 && (*buffer == '#' || *buffer == '\n')); // should be -1
-                    break;
-                }
-                else if (md == 1) {
-                    if(j) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    if(strpbrk(token+1, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    polaritiesPerForcedDim[line_ind] = (int *) malloc(sizeof(int) * numWordsPerForcedDim[line_ind]);
-                    for(k=0; k<numWordsPerForcedDim[line_ind]; k++) {polaritiesPerForcedDim[line_ind][k] = (*(token+1) == '+') ? 1:-1;}
-                    token = strtok(NULL, " "); // should be NULL
-                    break;
-                }
-                else if (md == 0) {
-                    if(token == NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    if(strpbrk(token, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-                    if(polaritiesPerForcedDim[line_ind] == 0) {polaritiesPerForcedDim[line_ind] = (int *) malloc(sizeof(int) * numWordsPerForcedDim[line_ind]);}
-                    polaritiesPerForcedDim[line_ind][j] = (*token == '+') ? 1:-1;
-                    token = strtok(NULL, " ");
-                }
-                else{fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-            }
-            if(token != NULL){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-            if(md == 2 && line_length > 0){fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-
-            // Next line
-            line_ind++;
+        int j,k;
+        wordStringsPerForcedDim = (char***) malloc(sizeof(char**) * numForcedDims);
+        for (j = 0; j < numForcedDims; j++){
+            wordStringsPerForcedDim[j] = (char**) malloc(sizeof(char*) * numWordsPerForcedDim[j]);
+            for(k = 0; k < numWordsPerForcedDim[j]; k++) wordStringsPerForcedDim[j][k] = vocab->words[wordIdsPerForcedDim[j][k] - 1];
         }
-        if(line_ind < numForcedDims && md != 2) {fprintf(stderr, "Incompatible file: %s.\n", polarities_file); return 1;}
-        free(buffer);
-        fclose(fid_polarities);
     }
+    // Polarities and k-values of each model, and its forcing index
+    for(m = 0; m < num_models; m++){
+        select_model(m);
+        if(read_polarities() != 0 || read_k_vals() != 0 || build_forcing_index() != 0) return 1;
+        keep_forcing(m);
+    }
+    return train_glove();
+}
 
+/* Number of entries of a comma-separated list */
+int count_list(const char *list) {
+    int n = 1;
+    for(; *list != '\0'; list++) n += (*list == ',');
+    return n;
+}
 
-    // k-values
-    {
-        FILE *fid_k_vals;
-
-        size_t buffersize = 0; // updated by the getline call
-        char *buffer = 0; // allocated and adjusted as needed by getline
-        int line_length; // includes the terminating newline
-
-        int line_ind, j, k, l;
-        char* token;
-        int md;
-
-        // k-values
-        fid_k_vals = fopen(k_vals_file, "r");
-        if(fid_k_vals == NULL) {fprintf(stderr, "Unable to open file %s.\n", k_vals_file); return 1;}
-
-        // Allocate memory and read
-        // kvalsPerForcedDim = (real**) malloc(sizeof(real*) * numForcedDims);
-        kvalsPerForcedDim = (real**) calloc(numForcedDims, sizeof(real*)); // initialize to NULLs
-
-        line_ind = 0;
-        while ((line_length = getline(&buffer, &buffersize, fid_k_vals)) > 0){
-            if(*buffer == '#') continue;
-            if(*buffer == '\n') continue;
-            if(line_ind == numForcedDims){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-
-            // Store the tokens
-            token = strtok(buffer, " ");
-            for(j=0; j<numWordsPerForcedDim[line_ind]; j++){
-                if((md = strspn(token, "*")) == 2){
-                    if(j) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(line_ind) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(strpbrk(token+2, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(!isdigit(*(token+2))){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;} // want to avoid disallowing 0 entirely
-                    for(l=0; l<numForcedDims; l++){
-                        kvalsPerForcedDim[l] = (real *) malloc(sizeof(real) * numWordsPerForcedDim[l]);
-                        for(k=0; k<numWordsPerForcedDim[l]; k++) {kvalsPerForcedDim[l][k] = atof(token+2);}
-                    }
-                    token = strtok(NULL, " "); // should be NULL
-                    do{line_length = getline(&buffer, &buffersize, fid_k_vals);} while(line_length > 0 && (*buffer == '#' || *buffer == '\n')); // should be -1
-                    break;
-                }
-                else if (md == 1) {
-                    if(j) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(strpbrk(token+1, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(!isdigit(*(token+1))){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;} // want to avoid disallowing 0 entirely
-                    kvalsPerForcedDim[line_ind] = (real *) malloc(sizeof(real) * numWordsPerForcedDim[line_ind]);
-                    for(k=0; k<numWordsPerForcedDim[line_ind]; k++) {kvalsPerForcedDim[line_ind][k] = atof(token+1);}
-                    token = strtok(NULL, " "); // should be NULL
-                    break;
-                }
-                else if (md == 0) {
-                    if(token == NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(strpbrk(token, "*") != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-                    if(!isdigit(*token)){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;} // want to avoid disallowing 0 entirely
-                    if(kvalsPerForcedDim[line_ind] == 0) {kvalsPerForcedDim[line_ind] = (real *) malloc(sizeof(real) * numWordsPerForcedDim[line_ind]);}
-                    kvalsPerForcedDim[line_ind][j] = atof(token);
-                    token = strtok(NULL, " ");
-                }
-                else{fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-            }
-            if(token != NULL){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-            if(md == 2 && line_length > 0){fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
+/* Split a comma-separated list in place into items, which must have room for all entries */
+void split_list(char *list, char **items) {
+    int n = 0;
+    items[n++] = list;
+    for(; *list != '\0'; list++) if(*list == ',') {*list = '\0'; items[n++] = list + 1;}
+}
 
-            // Next line
-            line_ind++;
-        }
-        if(line_ind < numForcedDims && md != 2) {fprintf(stderr, "Incompatible file: %s.\n", k_vals_file); return 1;}
-        free(buffer);
-        fclose(fid_k_vals);
+/* One model per entry of the -POLS_FILE and -KVALS_FILE lists; a list of one entry is shared by all models.
+   -save-file and -gradsq-file give one name per model, or one name that gets the suffix _<model> */
+int setup_models() {
+    int m, num_pols = count_list(polarities_file), num_kvals = count_list(k_vals_file);
+    int num_saves = count_list(save_W_file), num_gradsqs = (save_gradsq > 0) ? count_list(save_gradsq_file) : 1;
+    char **pols, **kvals, **saves, **gradsqs;
+
+    num_models = (num_pols > num_kvals) ? num_pols : num_kvals;
+    if((num_pols != 1 && num_pols != num_models) || (num_kvals != 1 && num_kvals != num_models)
+        || (num_saves != 1 && num_saves != num_models) || (num_gradsqs != 1 && num_gradsqs != num_models)) {
+        fprintf(stderr, "-POLS_FILE, -KVALS_FILE, -save-file and -gradsq-file take one entry or one per model (%d models).\n", num_models);
+        return 1;
     }
-
-
-    // String forms (for ease with debugging)
-    {
-        FILE *fid;
-        int matches;
-        int target;
-        int freqInd;
-        char format[20], str[MAX_STRING_LENGTH + 1];
-        long long unicount;
-        int i,j,k;
-
-        // Allocate memory
-        wordStringsPerForcedDim = (char***) malloc(sizeof(char**) * numForcedDims);
-        for (j = 0; j < numForcedDims; j++){
-            wordStringsPerForcedDim[j] = (char**) malloc(sizeof(char*) * numWordsPerForcedDim[j]);
-            for(k = 0; k < numWordsPerForcedDim[j]; k++)
-                wordStringsPerForcedDim[j][k] = (char*) malloc(sizeof(char) * (MAX_STRING_LENGTH + 1));
-        }
-
-        // Read the vocab file and match words against their freqIds (requires that the words have freqId's in ascending order.)
-        sprintf(format,"%%%ds %%lld", MAX_STRING_LENGTH);
-        for(i=0;i<numForcedDims;i++){
-            fid = fopen(vocab_file,"r");
-            if(fid == NULL) {fprintf(stderr, "Unable to open file %s.\n",vocab_file); return 1;}
-            freqInd = 1;
-            target = wordIdsPerForcedDim[i][0];
-            matches = 0;
-            while (fscanf(fid, format, str, &unicount) != EOF && matches<numWordsPerForcedDim[i]){
-                while(freqInd == target){
-                    strcpy(wordStringsPerForcedDim[i][matches], str);
-                    matches++;
-                    target = wordIdsPerForcedDim[i][matches];
-                }
-                freqInd++;
-            }
-            fclose(fid);
+    pols = (char **) malloc(sizeof(char *) * num_models);
+    kvals = (char **) malloc(sizeof(char *) * num_models);
+    saves = (char **) malloc(sizeof(char *) * num_models);
+    gradsqs = (char **) malloc(sizeof(char *) * num_models);
+    split_list(polarities_file, pols);
+    split_list(k_vals_file, kvals);
+    split_list(save_W_file, saves);
+    gradsqs[0] = save_gradsq_file;
+    if(save_gradsq > 0) split_list(save_gradsq_file, gradsqs);
+
+    models = (MODEL *) calloc(num_models, sizeof(MODEL));
+    for(m = 0; m < num_models; m++) {
+        models[m].polarities_file = pols[(num_pols == 1) ? 0 : m];
+        models[m].k_vals_file = kvals[(num_kvals == 1) ? 0 : m];
+        models[m].save_W_file = saves[(num_saves == 1) ? 0 : m];
+        models[m].save_gradsq_file = gradsqs[(num_gradsqs == 1) ? 0 : m];
+        if(num_models > 1 && num_saves == 1) {
+            models[m].save_W_file = malloc(sizeof(char) * (MAX_STRING_LENGTH + 16));
+            sprintf(models[m].save_W_file, "%s_%d", saves[0], m + 1);
         }
+        if(num_models > 1 && num_gradsqs == 1 && save_gradsq > 0) {
+            models[m].save_gradsq_file = malloc(sizeof(char) * (MAX_STRING_LENGTH + 16));
+            sprintf(models[m].save_gradsq_file, "%s_%d", gradsqs[0], m + 1);
+        }
+        if(verbose > 1 && num_models > 1) fprintf(stderr, "Model %d: polarities %s, k-values %s, output %s\n", m + 1, models[m].polarities_file, models[m].k_vals_file, models[m].save_W_file);
     }
-    return train_glove();
+    free(pols);
+    free(kvals);
+    free(saves);
+    free(gradsqs);
+    return 0;
 }
 
 int find_arg(char *str, int argc, char **argv) {
@@ -770,7 +2052,6 @@ int find_arg(char *str, int argc, char **argv) {
 
 int main(int argc, char **argv) {
     int i;
-    FILE *fid;
     vocab_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     input_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
     save_W_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
@@ -786,6 +2067,22 @@ int main(int argc, char **argv) {
         printf("\t\tDimension of word vector representations (excluding bias term); default 50\n");
         printf("\t-threads <int>\n");
         printf("\t\tNumber of threads; default 8\n");
+        printf("\t-schedule <int>\n");
+        printf("\t\t0: Hogwild, threads update shared rows without locks (default); 1: conflict-free, records are split into a grid of blocks by word and context id\n");
+        printf("\t\tand in each step the threads train on blocks sharing no rows with each other. The blocks are a copy of the whole cooccurrence file in memory\n");
+        printf("\t\t(block-compressed records are stored decoded, 12 bytes each), made once before training; a -in-memory mapping is dropped after the copy\n");
+        printf("\t-deterministic <int>\n");
+        printf("\t\tReproducible training: -schedule 1 with a fixed assignment of blocks to threads, so results are bit-identical for a given number of threads;\n");
+        printf("\t\tholds the records in memory as -schedule 1 does; default 0 (off)\n");
+        printf("\t-random-init <int>\n");
+        printf("\t\tInitialize the parameters randomly instead of from the initialization file. 0: off (default); 1: with rand(), in one thread;\n");
+        printf("\t\t2: with a counter-based generator, in parallel, giving the same values for any number of threads (and as 'generate_init_file -seed')\n");
+        printf("\t-seed <int>\n");
+        printf("\t\tSeed for -random-init; default 1\n");
+        printf("\t-block-grid <int>\n");
+        printf("\t\tNumber of word (and context) id ranges for -schedule 1; default 4 x threads\n");
+        printf("\t-chunk-size <int>\n");
+        printf("\t\tNumber of cooccurrence records per unit of work handed to the threads; default 16384\n");
         printf("\t-iter <int>\n");
         printf("\t\tNumber of training iterations; default 25\n");
         printf("\t-eta <float>\n");
@@ -796,6 +2093,12 @@ int main(int argc, char **argv) {
         printf("\t\tParameter specifying cutoff in weighting function; default 100.0\n");
         printf("\t-binary <int>\n");
         printf("\t\tSave output in binary format (0: text, 1: binary, 2: both); default 0\n");
+        printf("\t-save-emb <int>\n");
+        printf("\t\tAlso save the vectors of the chosen model as an indexed, memory-mappable file <save-file>.emb (see inc/embfile.h); default 0 (off)\n");
+        printf("\t-emb-dtype <int>\n");
+        printf("\t\tBits per value in the .emb file, 32 or 64; default: the precision of the build\n");
+        printf("\t-text-format <int>\n");
+        printf("\t\tValues in text output: 0: six decimals (default); 1: shortest text that reads back to the exact value (Grisu3; about five times slower than 0)\n");
         printf("\t-model <int>\n");
         printf("\t\tModel for word vector output (for text output only); default 2\n");
         printf("\t\t   0: output all data, for both word and context word vectors, including bias terms\n");
@@ -803,12 +2106,51 @@ int main(int argc, char **argv) {
         printf("\t\t   2: output word vectors + context word vectors, excluding bias terms\n");
         printf("\t-input-file <file>\n");
         printf("\t\tBinary input file of shuffled cooccurrence data (produced by 'cooccur' and 'shuffle'); default cooccurrence.shuf.bin\n");
+        printf("\t\tThe record format (see 'cooccur -format') is detected; training records written by 'shuffle -precompute 1' are used with their x_max and alpha\n");
+        printf("\t-in-memory <int>\n");
+        printf("\t\tKeep the cooccurrence data in memory across iterations (0: read from disk every iteration, 1: memory-map the file, 2: load the file into RAM); default 0\n");
+        printf("\t-isa <string>\n");
+        printf("\t\tInstruction set of the update kernel (auto, avx512, avx2 or generic); default auto\n");
         printf("\t-vocab-file <file>\n");
         printf("\t\tFile containing vocabulary (truncated unigram counts, produced by 'vocab_count'); default vocab.txt\n");
         printf("\t-save-file <file>\n");
         printf("\t\tFilename, excluding extension, for word vector output; default vectors\n");
         printf("\t-gradsq-file <file>\n");
         printf("\t\tFilename, excluding extension, for squared gradient output; default gradsq\n");
+        printf("\t-checkpoint-file <file>\n");
+        printf("\t\tFile for periodic checkpoints of the training state; default checkpoint.bin\n");
+        printf("\t-checkpoint-every <int>\n");
+        printf("\t\tWrite a checkpoint every <int> iterations; default 0 (off). W and gradsq of all models are copied at the end of the iteration\n\t\tand written in the background, which takes as much memory again as the parameters themselves\n");
+        printf("\t-checkpoint-minutes <float>\n");
+        printf("\t\tWrite a checkpoint at the end of an iteration once <float> minutes have passed since the last one; default 0 (off)\n");
+        printf("\t-resume <int>\n");
+        printf("\t\tContinue training from the checkpoint file instead of the initialization file; default 0 (off)\n");
+        printf("\t-warm-start <int>\n");
+        printf("\t\tStart from the W and gradsq of a model trained over the same vocabulary (-trained-vectors, -trained-gradsq) instead of the initialization file,\n");
+        printf("\t\tfor a short fine-tuning run (-finetune-iter, -finetune-eta), e.g. with other polarities or k-values; default 0 (off)\n");
+        printf("\t-finetune-iter <int>\n");
+        printf("\t\tNumber of training iterations of a warm start, in place of -iter; default 5\n");
+        printf("\t-finetune-eta <float>\n");
+        printf("\t\tLearning rate of a warm start, in place of -eta; default: -eta\n");
+        printf("\t-extend-vocab-file <file>\n");
+        printf("\t\tExtend a model trained over the vocabulary in <file> to the words of -vocab-file: its rows are mapped to the new ranks by word, new words are\n");
+        printf("\t\tinitialized randomly (see -seed), and only the records involving a new word are trained on; default off\n");
+        printf("\t-trained-vectors <file>\n");
+        printf("\t\tBinary vectors of the trained model for -warm-start or -extend-vocab-file (as saved with -binary 1 or 2); default vectors.bin\n");
+        printf("\t-trained-gradsq <file>\n");
+        printf("\t\tBinary squared gradients of the trained model (as saved with -save-gradsq 1); default gradsq.bin\n");
+        printf("\t-update-old <int>\n");
+        printf("\t\tWhen extending, also update the rows of the words of the trained model; default 0 (they are kept as they are)\n");
+        printf("\t-hugepages <int>\n");
+        printf("\t\tBack W and gradsq with huge pages. 0: off (default); 1: transparent huge pages; 2: explicit huge pages (falls back to 1)\n");
+        printf("\t-numa-interleave <int>\n");
+        printf("\t\tInterleave W and gradsq across all NUMA nodes; default 0 (off)\n");
+        printf("\t-pin-threads <int>\n");
+        printf("\t\tPin each training thread to its own CPU; default 0 (off)\n");
+        printf("\t-metrics-file <file>\n");
+        printf("\t\tWrite per-iteration and per-thread training metrics to <file> as JSON lines; default off\n");
+        printf("\t-forcing-mode <int>\n");
+        printf("\t\tApply the forcing term 0: on every record of a forced word, 1: as one proximal step per forced word and epoch, weighted by the word's total f(X); default 0\n");
         printf("\t-save-gradsq <int>\n");
         printf("\t\tSave accumulated squared gradients; default 0 (off); ignored if gradsq-file is specified\n");
         printf("\nExample usage:\n");
@@ -820,13 +2162,15 @@ int main(int argc, char **argv) {
     if ((i = find_arg((char *)"-vector-size", argc, argv)) > 0) vector_size = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-iter", argc, argv)) > 0) num_iter = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-threads", argc, argv)) > 0) num_threads = atoi(argv[i + 1]);
-    cost = malloc(sizeof(real) * num_threads);
     if ((i = find_arg((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
     if ((i = find_arg((char *)"-x-max", argc, argv)) > 0) x_max = atof(argv[i + 1]);
     if ((i = find_arg((char *)"-eta", argc, argv)) > 0) eta = atof(argv[i + 1]);
     if ((i = find_arg((char *)"-binary", argc, argv)) > 0) use_binary = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-model", argc, argv)) > 0) model = atoi(argv[i + 1]);
     if(model != 0 && model != 1) model = 2;
+    if ((i = find_arg((char *)"-save-emb", argc, argv)) > 0) save_emb = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-emb-dtype", argc, argv)) > 0) emb_dtype = (atoi(argv[i + 1]) == 32) ? EMB_DTYPE_FLOAT32 : EMB_DTYPE_FLOAT64;
+    if ((i = find_arg((char *)"-text-format", argc, argv)) > 0) shortest_text = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-save-gradsq", argc, argv)) > 0) save_gradsq = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-vocab-file", argc, argv)) > 0) strcpy(vocab_file, argv[i + 1]);
     else strcpy(vocab_file, (char *)"vocab.txt");
@@ -839,6 +2183,38 @@ int main(int argc, char **argv) {
     else if(save_gradsq > 0) strcpy(save_gradsq_file, (char *)"gradsq");
     if ((i = find_arg((char *)"-input-file", argc, argv)) > 0) strcpy(input_file, argv[i + 1]);
     else strcpy(input_file, (char *)"cooccurrence.shuf.bin");
+    if ((i = find_arg((char *)"-in-memory", argc, argv)) > 0) in_memory = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-isa", argc, argv)) > 0) simd_isa = argv[i + 1];
+    checkpoint_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
+    if ((i = find_arg((char *)"-checkpoint-file", argc, argv)) > 0) strcpy(checkpoint_file, argv[i + 1]);
+    else strcpy(checkpoint_file, (char *)"checkpoint.bin");
+    if ((i = find_arg((char *)"-checkpoint-every", argc, argv)) > 0) checkpoint_every = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-checkpoint-minutes", argc, argv)) > 0) checkpoint_minutes = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-resume", argc, argv)) > 0) resume_training = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-warm-start", argc, argv)) > 0) warm_start = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-finetune-iter", argc, argv)) > 0) finetune_iter = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-finetune-eta", argc, argv)) > 0) finetune_eta = atof(argv[i + 1]);
+    if (warm_start) {
+        num_iter = finetune_iter;
+        if (finetune_eta >= 0) eta = finetune_eta;
+    }
+    if ((i = find_arg((char *)"-extend-vocab-file", argc, argv)) > 0) extend_vocab_file = argv[i + 1];
+    trained_vectors_file = ((i = find_arg((char *)"-trained-vectors", argc, argv)) > 0) ? argv[i + 1] : (char *)"vectors.bin";
+    trained_gradsq_file = ((i = find_arg((char *)"-trained-gradsq", argc, argv)) > 0) ? argv[i + 1] : (char *)"gradsq.bin";
+    if ((i = find_arg((char *)"-update-old", argc, argv)) > 0) update_old = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-hugepages", argc, argv)) > 0) huge_pages = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-numa-interleave", argc, argv)) > 0) numa_interleave = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-pin-threads", argc, argv)) > 0) pin_threads = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-metrics-file", argc, argv)) > 0) metrics_file = argv[i + 1];
+    if ((i = find_arg((char *)"-forcing-mode", argc, argv)) > 0) forcing_mode = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-schedule", argc, argv)) > 0) schedule = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-deterministic", argc, argv)) > 0) deterministic = atoi(argv[i + 1]);
+    if (deterministic) schedule = 1;
+    if ((i = find_arg((char *)"-random-init", argc, argv)) > 0) ignore_init_file = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-seed", argc, argv)) > 0) seed = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-block-grid", argc, argv)) > 0) block_grid = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-chunk-size", argc, argv)) > 0) chunk_size = atoll(argv[i + 1]);
+    if (chunk_size < 1) chunk_size = 1;
     
     // Additional input arguments defined here: (declare such variables globally with a default definition)
     //
@@ -851,28 +2227,32 @@ int main(int argc, char **argv) {
         if ((i = find_arg((char *)"-DIMS_FILE", argc, argv)) > 0) strcpy(forced_dims_file, argv[i + 1]);
         else strcpy(forced_dims_file, (char *)"Params/forced_up_to_300");
 
-        polarities_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
-        if ((i = find_arg((char *)"-POLS_FILE", argc, argv)) > 0) strcpy(polarities_file, argv[i + 1]);
-        else strcpy(polarities_file, (char *)"Params/positive_all");
+        // Comma-separated lists of polarities and k-values files train one model per entry
+        if ((i = find_arg((char *)"-POLS_FILE", argc, argv)) > 0) polarities_file = strdup(argv[i + 1]);
+        else polarities_file = strdup("Params/positive_all");
 
         forced_word_ids_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
         if ((i = find_arg((char *)"-FORCEDIDS_FILE", argc, argv)) > 0) strcpy(forced_word_ids_file, argv[i + 1]);
         else strcpy(forced_word_ids_file, (char *)"Params/forced_words_roget_300");
 
-        k_vals_file = malloc(sizeof(char) * MAX_STRING_LENGTH);
-        if ((i = find_arg((char *)"-KVALS_FILE", argc, argv)) > 0) strcpy(k_vals_file, argv[i + 1]);
-        else strcpy(k_vals_file, (char *)"Params/k_0.1_all");
+        if ((i = find_arg((char *)"-KVALS_FILE", argc, argv)) > 0) k_vals_file = strdup(argv[i + 1]);
+        else k_vals_file = strdup("Params/k_0.1_all");
     }
+    if(setup_models() != 0) return 1;
+    if(posix_memalign((void **)&thread_stats, 64, sizeof(THREADSTATS) * num_threads * num_models) != 0) {fprintf(stderr, "Error allocating memory for thread statistics\n"); return 1;}
 
-    vocab_size = 0;
-    fid = fopen(vocab_file, "r");
-    if(fid == NULL) {fprintf(stderr, "Unable to open vocab file %s.\n",vocab_file); return 1;}
-    while ((i = getc(fid)) != EOF) if (i == '\n') vocab_size++; // Count number of entries in vocab_file
-    fclose(fid);
+    vocab = loadVocab(vocab_file);
+    if(vocab == NULL) {fprintf(stderr, "Unable to open vocab file %s.\n",vocab_file); return 1;}
+    vocab_size = vocab->size;
     
     if(forcing_enabled) return get_forced_dims();
     else{
         numForcedDims = 0;
+        for(i = 0; i < num_models; i++){
+            select_model(i);
+            if(build_forcing_index() != 0) return 1;
+            keep_forcing(i);
+        }
         return train_glove();
     }
 }
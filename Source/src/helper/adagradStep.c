@@ -0,0 +1,246 @@
+#include "helperfuncs.h"
+#include <string.h>
+#include <tgmath.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/*
+ * Fused GloVe/AdaGrad step for one cooccurrence record: the dot product of the
+ * word row w1 and the context row w2 (plus both biases, stored at index size),
+ * followed by the AdaGrad update of both rows and both biases. The loop is
+ * branch-free; the caller patches the forced dims afterwards.
+ * Returns dot + biases - logx.
+ */
+
+typedef real (*adagradStepFn)(real*, real*, real*, real*, int, real, real, real);
+
+/* Portable version, left to the compiler to vectorize */
+static real adagradStepGeneric(real* w1, real* w2, real* gs1, real* gs2, int size, real logx, real weight, real eta)
+{
+	int i;
+	real diff = 0.0, step, g1, g2;
+	for(i=0; i<size; i++) diff += w1[i] * w2[i];
+	diff += w1[size] + w2[size] - logx;
+	step = eta * weight * diff;
+	for(i=0; i<=size; i++)
+	{
+		g1 = (i < size) ? step * w2[i] : step;
+		g2 = (i < size) ? step * w1[i] : step;
+		w1[i] -= g1 / sqrt(gs1[i]);
+		w2[i] -= g2 / sqrt(gs2[i]);
+		gs1[i] += g1 * g1;
+		gs2[i] += g2 * g2;
+	}
+	return diff;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+#ifdef SINGLE_PRECISION
+#define V2 __m256
+#define V2_WIDTH 8
+#define V2_LOAD _mm256_loadu_ps
+#define V2_STORE _mm256_storeu_ps
+#define V2_SET1 _mm256_set1_ps
+#define V2_ZERO _mm256_setzero_ps
+#define V2_ADD _mm256_add_ps
+#define V2_MUL _mm256_mul_ps
+#define V2_FMADD _mm256_fmadd_ps
+#define V2_FNMADD _mm256_fnmadd_ps
+#define V2_RSQRT_EST _mm256_rsqrt_ps
+#define V2_NEWTON_STEPS 1
+#define V2_ADAGRAD(a, d, s) V2_FNMADD(d, v2InvSqrt(s), a)
+#define V5 __m512
+#define V5_WIDTH 16
+#define V5_MASK __mmask16
+#define V5_MASKZ_LOAD _mm512_maskz_loadu_ps
+#define V5_MASK_STORE _mm512_mask_storeu_ps
+#define V5_SET1 _mm512_set1_ps
+#define V5_ZERO _mm512_setzero_ps
+#define V5_MUL _mm512_mul_ps
+#define V5_FMADD _mm512_fmadd_ps
+#define V5_FNMADD _mm512_fnmadd_ps
+#define V5_RSQRT_EST _mm512_rsqrt14_ps
+#define V5_NEWTON_STEPS 1
+#define V5_REDUCE _mm512_reduce_add_ps
+#define V5_ADAGRAD(a, d, s) V5_FNMADD(d, v5InvSqrt(s), a)
+#else
+#define V2 __m256d
+#define V2_WIDTH 4
+#define V2_LOAD _mm256_loadu_pd
+#define V2_STORE _mm256_storeu_pd
+#define V2_SET1 _mm256_set1_pd
+#define V2_ZERO _mm256_setzero_pd
+#define V2_ADD _mm256_add_pd
+#define V2_MUL _mm256_mul_pd
+#define V2_FMADD _mm256_fmadd_pd
+#define V2_FNMADD _mm256_fnmadd_pd
+#define V2_ADAGRAD(a, d, s) _mm256_sub_pd(a, _mm256_div_pd(d, _mm256_sqrt_pd(s)))
+#define V5 __m512d
+#define V5_WIDTH 8
+#define V5_MASK __mmask8
+#define V5_MASKZ_LOAD _mm512_maskz_loadu_pd
+#define V5_MASK_STORE _mm512_mask_storeu_pd
+#define V5_SET1 _mm512_set1_pd
+#define V5_ZERO _mm512_setzero_pd
+#define V5_MUL _mm512_mul_pd
+#define V5_FMADD _mm512_fmadd_pd
+#define V5_FNMADD _mm512_fnmadd_pd
+#define V5_REDUCE _mm512_reduce_add_pd
+#define V5_ADAGRAD(a, d, s) _mm512_sub_pd(a, _mm512_div_pd(d, _mm512_sqrt_pd(s)))
+#endif
+
+/*
+ * w - g / sqrt(gradsq) for one register. In single precision, 1/sqrt(gradsq) comes from the hardware
+ * estimate refined by Newton steps, y <- y * (1.5 - 0.5 * x * y * y), each of which doubles the number of
+ * correct bits (12 or 14 to start with); this replaces a sqrt and a divide, the bottleneck of the update.
+ * Double precision keeps the sqrt and the divide: there is no double estimate on AVX2, going through
+ * float overflows for gradsq past FLT_MAX, and the result should not depend on the kernel dispatched.
+ */
+#ifdef SINGLE_PRECISION
+__attribute__((target("avx2,fma")))
+static inline V2 v2InvSqrt(V2 x)
+{
+	int k;
+	V2 y = V2_RSQRT_EST(x), h = V2_MUL(x, V2_SET1(0.5));
+	for(k=0; k<V2_NEWTON_STEPS; k++) y = V2_MUL(y, V2_FNMADD(V2_MUL(h, y), y, V2_SET1(1.5)));
+	return y;
+}
+
+__attribute__((target("avx512f")))
+static inline V5 v5InvSqrt(V5 x)
+{
+	int k;
+	V5 y = V5_RSQRT_EST(x), h = V5_MUL(x, V5_SET1(0.5));
+	for(k=0; k<V5_NEWTON_STEPS; k++) y = V5_MUL(y, V5_FNMADD(V5_MUL(h, y), y, V5_SET1(1.5)));
+	return y;
+}
+#endif
+
+/* AVX2 + FMA version; the tail that does not fill a register (and the biases) is done in scalar code */
+__attribute__((target("avx2,fma")))
+static real adagradStepAvx2(real* w1, real* w2, real* gs1, real* gs2, int size, real logx, real weight, real eta)
+{
+	int i, j;
+	int vsize = size - size % V2_WIDTH;
+	real diff, step, g1, g2;
+	real lanes[V2_WIDTH];
+	V2 acc0 = V2_ZERO(), acc1 = V2_ZERO();
+	V2 a, b, s1, s2, vstep, d1, d2;
+
+	for(i=0; i + 2*V2_WIDTH <= vsize; i += 2*V2_WIDTH)
+	{
+		acc0 = V2_FMADD(V2_LOAD(w1 + i), V2_LOAD(w2 + i), acc0);
+		acc1 = V2_FMADD(V2_LOAD(w1 + i + V2_WIDTH), V2_LOAD(w2 + i + V2_WIDTH), acc1);
+	}
+	if(i < vsize) acc0 = V2_FMADD(V2_LOAD(w1 + i), V2_LOAD(w2 + i), acc0);
+	V2_STORE(lanes, V2_ADD(acc0, acc1));
+	diff = 0.0;
+	for(j=0; j<V2_WIDTH; j++) diff += lanes[j];
+	for(i=vsize; i<size; i++) diff += w1[i] * w2[i];
+	diff += w1[size] + w2[size] - logx;
+
+	step = eta * weight * diff;
+	vstep = V2_SET1(step);
+	for(i=0; i<vsize; i += V2_WIDTH)
+	{
+		a = V2_LOAD(w1 + i);
+		b = V2_LOAD(w2 + i);
+		s1 = V2_LOAD(gs1 + i);
+		s2 = V2_LOAD(gs2 + i);
+		d1 = V2_MUL(vstep, b);
+		d2 = V2_MUL(vstep, a);
+		V2_STORE(w1 + i, V2_ADAGRAD(a, d1, s1));
+		V2_STORE(w2 + i, V2_ADAGRAD(b, d2, s2));
+		V2_STORE(gs1 + i, V2_FMADD(d1, d1, s1));
+		V2_STORE(gs2 + i, V2_FMADD(d2, d2, s2));
+	}
+	for(i=vsize; i<=size; i++)
+	{
+		g1 = (i < size) ? step * w2[i] : step;
+		g2 = (i < size) ? step * w1[i] : step;
+		w1[i] -= g1 / sqrt(gs1[i]);
+		w2[i] -= g2 / sqrt(gs2[i]);
+		gs1[i] += g1 * g1;
+		gs2[i] += g2 * g2;
+	}
+	return diff;
+}
+
+/* AVX-512 version; the tail is handled with masked loads and stores */
+__attribute__((target("avx512f")))
+static real adagradStepAvx512(real* w1, real* w2, real* gs1, real* gs2, int size, real logx, real weight, real eta)
+{
+	int i;
+	real diff, step;
+	V5_MASK m;
+	V5 acc = V5_ZERO();
+	V5 a, b, s1, s2, vstep, d1, d2;
+
+	for(i=0; i<size; i += V5_WIDTH)
+	{
+		m = (size - i >= V5_WIDTH) ? (V5_MASK)~0 : (V5_MASK)((1u << (size - i)) - 1);
+		acc = V5_FMADD(V5_MASKZ_LOAD(m, w1 + i), V5_MASKZ_LOAD(m, w2 + i), acc);
+	}
+	diff = V5_REDUCE(acc) + w1[size] + w2[size] - logx;
+
+	step = eta * weight * diff;
+	vstep = V5_SET1(step);
+	for(i=0; i<size; i += V5_WIDTH)
+	{
+		m = (size - i >= V5_WIDTH) ? (V5_MASK)~0 : (V5_MASK)((1u << (size - i)) - 1);
+		a = V5_MASKZ_LOAD(m, w1 + i);
+		b = V5_MASKZ_LOAD(m, w2 + i);
+		s1 = V5_MASKZ_LOAD(m, gs1 + i);
+		s2 = V5_MASKZ_LOAD(m, gs2 + i);
+		d1 = V5_MUL(vstep, b);
+		d2 = V5_MUL(vstep, a);
+		V5_MASK_STORE(w1 + i, m, V5_ADAGRAD(a, d1, s1));
+		V5_MASK_STORE(w2 + i, m, V5_ADAGRAD(b, d2, s2));
+		V5_MASK_STORE(gs1 + i, m, V5_FMADD(d1, d1, s1));
+		V5_MASK_STORE(gs2 + i, m, V5_FMADD(d2, d2, s2));
+	}
+	w1[size] -= step / sqrt(gs1[size]);
+	w2[size] -= step / sqrt(gs2[size]);
+	gs1[size] += step * step;
+	gs2[size] += step * step;
+	return diff;
+}
+
+#endif
+
+static adagradStepFn adagradStepImpl = adagradStepGeneric;
+
+/* Select the kernel: "auto" (or NULL) picks the widest instruction set the CPU supports. Returns the name of the kernel in use. */
+const char* adagradStepInit(const char* isa)
+{
+	const char* name = "generic";
+	adagradStepImpl = adagradStepGeneric;
+#ifdef HAVE_X86_KERNELS
+	__builtin_cpu_init();
+	if(isa == NULL || strcmp(isa, "auto") == 0)
+	{
+		if(__builtin_cpu_supports("avx512f")) isa = "avx512";
+		else if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) isa = "avx2";
+		else isa = "generic";
+	}
+	if(strcmp(isa, "avx512") == 0 && __builtin_cpu_supports("avx512f"))
+	{
+		adagradStepImpl = adagradStepAvx512;
+		name = "avx512";
+	}
+	else if(strcmp(isa, "avx2") == 0 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+	{
+		adagradStepImpl = adagradStepAvx2;
+		name = "avx2";
+	}
+#endif
+	return name;
+}
+
+real adagradStep(real* w1, real* w2, real* gs1, real* gs2, int size, real logx, real weight, real eta)
+{
+	return adagradStepImpl(w1, w2, gs1, gs2, size, logx, weight, eta);
+}
@@ -0,0 +1,73 @@
+#include "embfile.h"
+#include "helperfuncs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define EMB_MAGIC "GLVEMB1"
+
+unsigned long long embHash(const char* word)
+{
+	return fnv1a(word, strlen(word), FNV1A_BASIS);
+}
+
+EMBFILE* openEmbFile(const char* path)
+{
+	struct stat st;
+	const EMBHDR* h;
+	EMBFILE* e;
+	void* data;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return NULL;
+	if(fstat(fd, &st) != 0 || st.st_size < sizeof(EMBHDR)) {close(fd); return NULL;}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) return NULL;
+	h = (const EMBHDR*)data;
+	if(memcmp(h->magic, EMB_MAGIC, sizeof(EMB_MAGIC)) != 0 || (h->dtype != EMB_DTYPE_FLOAT32 && h->dtype != EMB_DTYPE_FLOAT64)
+		|| h->index_offset + h->index_slots * (long long)sizeof(unsigned int) > st.st_size)
+	{
+		munmap(data, st.st_size);
+		return NULL;
+	}
+	e = malloc(sizeof(EMBFILE));
+	e->header = h;
+	e->size = st.st_size;
+	e->row_bytes = (size_t)h->dim * ((h->dtype == EMB_DTYPE_FLOAT32) ? 4 : 8);
+	e->matrix = (const char*)data + h->matrix_offset;
+	e->string_offsets = (const unsigned long long*)((const char*)data + h->strings_offset);
+	e->strings = (const char*)(e->string_offsets + h->rows + 1);
+	e->index = (const unsigned int*)((const char*)data + h->index_offset);
+	return e;
+}
+
+void closeEmbFile(EMBFILE* e)
+{
+	munmap((void*)e->header, e->size);
+	free(e);
+}
+
+long long embLookup(const EMBFILE* e, const char* word)
+{
+	unsigned long long mask = e->header->index_slots - 1, slot = embHash(word) & mask;
+	unsigned int row;
+	while((row = e->index[slot]) != 0)
+	{
+		if(strcmp(e->strings + e->string_offsets[row - 1], word) == 0) return row - 1;
+		slot = (slot + 1) & mask;
+	}
+	return -1;
+}
+
+const void* embRow(const EMBFILE* e, long long row)
+{
+	return e->matrix + row * e->row_bytes;
+}
+
+const char* embWord(const EMBFILE* e, long long row)
+{
+	return e->strings + e->string_offsets[row];
+}
@@ -0,0 +1,14 @@
+#include "helperfuncs.h"
+
+/* FNV-1a, 64-bit; chaining calls through h hashes the concatenation of their data */
+unsigned long long fnv1a(const void* data, size_t length, unsigned long long h)
+{
+	const unsigned char* p = (const unsigned char*)data;
+	size_t i;
+	for(i = 0; i < length; i++)
+	{
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
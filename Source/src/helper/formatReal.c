@@ -0,0 +1,290 @@
+#include "helperfuncs.h"
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#define FIXED_TIE_MARGIN 1e-3
+
+/* Same text as sprintf(buf, "%lf", x): six decimals done with integer arithmetic, falling back to sprintf near rounding ties */
+static int formatFixed(char* buf, double x)
+{
+	double scaled, rounded;
+	long long m, whole;
+	int frac, i, n = 0;
+	char digits[24];
+	unsigned long long bits;
+	memcpy(&bits, &x, sizeof(bits)); // Tested on the bits, since -Ofast assumes there are no infinities or NaNs
+	if((bits >> 52 & 0x7ff) == 0x7ff || fabs(x) >= 1e6) return sprintf(buf, "%lf", x);
+	scaled = x * 1e6;
+	rounded = nearbyint(scaled);
+	if(fabs(fabs(scaled - rounded) - 0.5) < FIXED_TIE_MARGIN) return sprintf(buf, "%lf", x); // Too close to call from the scaled product
+	m = llabs((long long)rounded);
+	whole = m / 1000000;
+	frac = m % 1000000;
+	if(signbit(x)) buf[n++] = '-';
+	i = 0;
+	do {digits[i++] = '0' + whole % 10; whole /= 10;} while(whole > 0);
+	while(i > 0) buf[n++] = digits[--i];
+	buf[n++] = '.';
+	for(i = 5; i >= 0; i--) {buf[n + i] = '0' + frac % 10; frac /= 10;}
+	n += 6;
+	buf[n] = '\0';
+	return n;
+}
+
+/*
+ * Shortest text: Grisu3 (Loitsch, "Printing floating-point numbers quickly and accurately with integers", PLDI 2010), as in the
+ * double-conversion library. The value and the bounds of the interval of reals that read back to it are scaled by a cached power
+ * of ten into 64-bit integers; digits are generated until they fall inside the interval, then the last one is moved towards the
+ * value. When the rounding errors of the scaling leave the shortest or the closest digits in doubt (about 0.5% of values), it
+ * says so, and the digits come from sprintf at increasing precision instead.
+ */
+
+#ifdef SINGLE_PRECISION
+#define SHORTEST_MOST_DIGITS 9
+#else
+#define SHORTEST_MOST_DIGITS 17
+#endif
+
+typedef struct diy_fp { // f * 2^e
+	unsigned long long f;
+	int e;
+} DIYFP;
+
+typedef struct cached_power { // 10^decimal ~= f * 2^e, f normalized and rounded
+	unsigned long long f;
+	int e, decimal;
+} CACHEDPOWER;
+
+static const CACHEDPOWER cachedPowers[] = {
+	{0xfa8fd5a0081c0288ULL, -1220, -348}, {0xbaaee17fa23ebf76ULL, -1193, -340}, {0x8b16fb203055ac76ULL, -1166, -332},
+	{0xcf42894a5dce35eaULL, -1140, -324}, {0x9a6bb0aa55653b2dULL, -1113, -316}, {0xe61acf033d1a45dfULL, -1087, -308},
+	{0xab70fe17c79ac6caULL, -1060, -300}, {0xff77b1fcbebcdc4fULL, -1034, -292}, {0xbe5691ef416bd60cULL, -1007, -284},
+	{0x8dd01fad907ffc3cULL, -980, -276}, {0xd3515c2831559a83ULL, -954, -268}, {0x9d71ac8fada6c9b5ULL, -927, -260},
+	{0xea9c227723ee8bcbULL, -901, -252}, {0xaecc49914078536dULL, -874, -244}, {0x823c12795db6ce57ULL, -847, -236},
+	{0xc21094364dfb5637ULL, -821, -228}, {0x9096ea6f3848984fULL, -794, -220}, {0xd77485cb25823ac7ULL, -768, -212},
+	{0xa086cfcd97bf97f4ULL, -741, -204}, {0xef340a98172aace5ULL, -715, -196}, {0xb23867fb2a35b28eULL, -688, -188},
+	{0x84c8d4dfd2c63f3bULL, -661, -180}, {0xc5dd44271ad3cdbaULL, -635, -172}, {0x936b9fcebb25c996ULL, -608, -164},
+	{0xdbac6c247d62a584ULL, -582, -156}, {0xa3ab66580d5fdaf6ULL, -555, -148}, {0xf3e2f893dec3f126ULL, -529, -140},
+	{0xb5b5ada8aaff80b8ULL, -502, -132}, {0x87625f056c7c4a8bULL, -475, -124}, {0xc9bcff6034c13053ULL, -449, -116},
+	{0x964e858c91ba2655ULL, -422, -108}, {0xdff9772470297ebdULL, -396, -100}, {0xa6dfbd9fb8e5b88fULL, -369, -92},
+	{0xf8a95fcf88747d94ULL, -343, -84}, {0xb94470938fa89bcfULL, -316, -76}, {0x8a08f0f8bf0f156bULL, -289, -68},
+	{0xcdb02555653131b6ULL, -263, -60}, {0x993fe2c6d07b7facULL, -236, -52}, {0xe45c10c42a2b3b06ULL, -210, -44},
+	{0xaa242499697392d3ULL, -183, -36}, {0xfd87b5f28300ca0eULL, -157, -28}, {0xbce5086492111aebULL, -130, -20},
+	{0x8cbccc096f5088ccULL, -103, -12}, {0xd1b71758e219652cULL, -77, -4}, {0x9c40000000000000ULL, -50, 4},
+	{0xe8d4a51000000000ULL, -24, 12}, {0xad78ebc5ac620000ULL, 3, 20}, {0x813f3978f8940984ULL, 30, 28},
+	{0xc097ce7bc90715b3ULL, 56, 36}, {0x8f7e32ce7bea5c70ULL, 83, 44}, {0xd5d238a4abe98068ULL, 109, 52},
+	{0x9f4f2726179a2245ULL, 136, 60}, {0xed63a231d4c4fb27ULL, 162, 68}, {0xb0de65388cc8ada8ULL, 189, 76},
+	{0x83c7088e1aab65dbULL, 216, 84}, {0xc45d1df942711d9aULL, 242, 92}, {0x924d692ca61be758ULL, 269, 100},
+	{0xda01ee641a708deaULL, 295, 108}, {0xa26da3999aef774aULL, 322, 116}, {0xf209787bb47d6b85ULL, 348, 124},
+	{0xb454e4a179dd1877ULL, 375, 132}, {0x865b86925b9bc5c2ULL, 402, 140}, {0xc83553c5c8965d3dULL, 428, 148},
+	{0x952ab45cfa97a0b3ULL, 455, 156}, {0xde469fbd99a05fe3ULL, 481, 164}, {0xa59bc234db398c25ULL, 508, 172},
+	{0xf6c69a72a3989f5cULL, 534, 180}, {0xb7dcbf5354e9beceULL, 561, 188}, {0x88fcf317f22241e2ULL, 588, 196},
+	{0xcc20ce9bd35c78a5ULL, 614, 204}, {0x98165af37b2153dfULL, 641, 212}, {0xe2a0b5dc971f303aULL, 667, 220},
+	{0xa8d9d1535ce3b396ULL, 694, 228}, {0xfb9b7cd9a4a7443cULL, 720, 236}, {0xbb764c4ca7a44410ULL, 747, 244},
+	{0x8bab8eefb6409c1aULL, 774, 252}, {0xd01fef10a657842cULL, 800, 260}, {0x9b10a4e5e9913129ULL, 827, 268},
+	{0xe7109bfba19c0c9dULL, 853, 276}, {0xac2820d9623bf429ULL, 880, 284}, {0x80444b5e7aa7cf85ULL, 907, 292},
+	{0xbf21e44003acdd2dULL, 933, 300}, {0x8e679c2f5e44ff8fULL, 960, 308}, {0xd433179d9c8cb841ULL, 986, 316},
+	{0x9e19db92b4e31ba9ULL, 1013, 324}, {0xeb96bf6ebadf77d9ULL, 1039, 332}, {0xaf87023b9bf0ee6bULL, 1066, 340},
+};
+
+#define CACHED_POWERS_OFFSET 348 // -decimal of cachedPowers[0]
+#define CACHED_POWERS_STEP 8
+
+static DIYFP diyNormalize(DIYFP a)
+{
+	int s = __builtin_clzll(a.f);
+	a.f <<= s;
+	a.e -= s;
+	return a;
+}
+
+/* Product, rounded to 64 bits */
+static DIYFP diyTimes(DIYFP a, DIYFP b)
+{
+	unsigned __int128 p = (unsigned __int128)a.f * b.f;
+	DIYFP r;
+	r.f = (unsigned long long)(p >> 64) + ((unsigned long long)p >> 63);
+	r.e = a.e + b.e + 64;
+	return r;
+}
+
+/* Move the last digit towards w while the digits stay in the safe interval; 0 if the result is not certain to be the closest */
+static int roundWeed(char* digits, int n, unsigned long long distance_too_high_w, unsigned long long unsafe_interval,
+	unsigned long long rest, unsigned long long ten_kappa, unsigned long long unit)
+{
+	unsigned long long small_distance = distance_too_high_w - unit, big_distance = distance_too_high_w + unit;
+	while(rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+		(rest + ten_kappa < small_distance || small_distance - rest >= rest + ten_kappa - small_distance))
+	{
+		digits[n - 1]--;
+		rest += ten_kappa;
+	}
+	if(rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+		(rest + ten_kappa < big_distance || big_distance - rest > rest + ten_kappa - big_distance))
+		return 0;
+	return (2 * unit <= rest) && (rest <= unsafe_interval - 4 * unit);
+}
+
+/* Shortest digits of the value significand * 2^exponent that read back to it (lower_closer: the real below is half as far as the
+   one above); the value is digits * 10^*decimal. Returns how many digits, or 0 if Grisu3 cannot be sure of them. */
+static int grisu3(unsigned long long significand, int exponent, int lower_closer, char* digits, int* decimal)
+{
+	DIYFP w, plus, minus, ten_mk, low, high, too_low, too_high, one;
+	unsigned long long unit = 1, fractionals, unsafe_interval, rest;
+	unsigned int integrals, divisor;
+	int k, index, kappa, n = 0;
+	const CACHEDPOWER* c;
+
+	w.f = significand;
+	w.e = exponent;
+	w = diyNormalize(w);
+	plus.f = (significand << 1) + 1;
+	plus.e = exponent - 1;
+	plus = diyNormalize(plus);
+	minus.f = lower_closer ? (significand << 2) - 1 : (significand << 1) - 1;
+	minus.e = lower_closer ? exponent - 2 : exponent - 1;
+	minus.f <<= minus.e - plus.e;
+	minus.e = plus.e;
+
+	// A power of ten that brings the binary exponent of w into [-60, -32]
+	k = (int)ceil((-60 - (w.e + 64) + 64 - 1) * 0.30102999566398114);
+	index = (CACHED_POWERS_OFFSET + k - 1) / CACHED_POWERS_STEP + 1;
+	c = &cachedPowers[index];
+	ten_mk.f = c->f;
+	ten_mk.e = c->e;
+	w = diyTimes(w, ten_mk);
+	low = diyTimes(minus, ten_mk);
+	high = diyTimes(plus, ten_mk);
+
+	// Each bound is off by less than one unit: digits between too_low and too_high may not read back; those inside the bounds
+	// shrunk by one unit surely do
+	too_low.f = low.f - unit;
+	too_high.f = high.f + unit;
+	too_low.e = too_high.e = w.e;
+	unsafe_interval = too_high.f - too_low.f;
+	one.f = 1ULL << -w.e;
+	one.e = w.e;
+	integrals = (unsigned int)(too_high.f >> -one.e);
+	fractionals = too_high.f & (one.f - 1);
+	for(divisor = 1, kappa = 1; integrals / divisor >= 10; divisor *= 10) kappa++;
+	while(kappa > 0)
+	{
+		digits[n++] = '0' + integrals / divisor;
+		integrals %= divisor;
+		kappa--;
+		rest = ((unsigned long long)integrals << -one.e) + fractionals;
+		if(rest < unsafe_interval)
+		{
+			*decimal = -c->decimal + kappa;
+			return roundWeed(digits, n, too_high.f - w.f, unsafe_interval, rest, (unsigned long long)divisor << -one.e, unit) ? n : 0;
+		}
+		divisor /= 10;
+	}
+	while(1)
+	{
+		fractionals *= 10;
+		unit *= 10;
+		unsafe_interval *= 10;
+		digits[n++] = '0' + (int)(fractionals >> -one.e);
+		fractionals &= one.f - 1;
+		kappa--;
+		if(fractionals < unsafe_interval)
+		{
+			*decimal = -c->decimal + kappa;
+			return roundWeed(digits, n, (too_high.f - w.f) * unit, unsafe_interval, fractionals, one.f, unit) ? n : 0;
+		}
+	}
+}
+
+/* Shortest correctly rounded digits by trying each precision in turn, for the values Grisu3 leaves in doubt */
+static int sprintfDigits(real x, char* digits, int* decimal)
+{
+	char text[40];
+	int precision, n = 0, i;
+	for(precision = 1; precision < SHORTEST_MOST_DIGITS; precision++)
+	{
+		sprintf(text, "%.*e", precision - 1, (double)x);
+		if((real)strtod(text, NULL) == x) break;
+	}
+	sprintf(text, "%.*e", precision - 1, (double)x);
+	for(i = (text[0] == '-'); text[i] != 'e'; i++) if(text[i] != '.') digits[n++] = text[i];
+	*decimal = atoi(text + i + 1) - (n - 1);
+	return n;
+}
+
+/* Fewest significant digits that read back as the same real; laid out as printf("%.17g") (%.9g in single precision) would */
+static int formatShortest(char* buf, real x)
+{
+	char digits[SHORTEST_MOST_DIGITS + 8];
+	unsigned long long bits, significand;
+	int biased, exponent, lower_closer, n, decimal, point, i, len = 0;
+#ifdef SINGLE_PRECISION
+	unsigned int bits32;
+	memcpy(&bits32, &x, sizeof(bits32));
+	bits = bits32;
+	biased = bits >> 23 & 0xff;
+	significand = bits & 0x7fffff;
+	lower_closer = (significand == 0 && biased > 1);
+	if(biased == 0xff) return sprintf(buf, "%g", (double)x);
+	if(biased > 0) significand |= 0x800000;
+	exponent = ((biased > 0) ? biased : 1) - 150;
+	if(bits >> 31) buf[len++] = '-';
+#else
+	memcpy(&bits, &x, sizeof(bits)); // Tested on the bits, since -Ofast assumes there are no infinities or NaNs
+	biased = bits >> 52 & 0x7ff;
+	significand = bits & 0xfffffffffffffULL;
+	lower_closer = (significand == 0 && biased > 1);
+	if(biased == 0x7ff) return sprintf(buf, "%g", x);
+	if(biased > 0) significand |= 0x10000000000000ULL;
+	exponent = ((biased > 0) ? biased : 1) - 1075;
+	if(bits >> 63) buf[len++] = '-';
+#endif
+	if(significand == 0)
+	{
+		buf[len++] = '0';
+		buf[len] = '\0';
+		return len;
+	}
+	n = grisu3(significand, exponent, lower_closer, digits, &decimal);
+	if(n == 0) n = sprintfDigits(x, digits, &decimal);
+	while(n > 1 && digits[n - 1] == '0') {n--; decimal++;}
+	point = n + decimal; // Digits before the decimal point
+	if(point - 1 < -4 || point - 1 >= SHORTEST_MOST_DIGITS) // d.ddde+XX
+	{
+		buf[len++] = digits[0];
+		if(n > 1)
+		{
+			buf[len++] = '.';
+			memcpy(buf + len, digits + 1, n - 1);
+			len += n - 1;
+		}
+		len += sprintf(buf + len, "e%c%02d", (point - 1 < 0) ? '-' : '+', abs(point - 1));
+		return len;
+	}
+	if(point <= 0)
+	{
+		buf[len++] = '0';
+		buf[len++] = '.';
+		for(i = point; i < 0; i++) buf[len++] = '0';
+		memcpy(buf + len, digits, n);
+		len += n;
+	}
+	else
+	{
+		for(i = 0; i < point; i++) buf[len++] = (i < n) ? digits[i] : '0';
+		if(n > point)
+		{
+			buf[len++] = '.';
+			memcpy(buf + len, digits + point, n - point);
+			len += n - point;
+		}
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+int formatReal(char* buf, real x, int shortest)
+{
+	return shortest ? formatShortest(buf, x) : formatFixed(buf, x);
+}
@@ -0,0 +1,48 @@
+#include "helperfuncs.h"
+
+/*
+ * Counter-based random initialization: value i of row r is a function of (seed, r, i) only, so rows
+ * can be filled in any order and by any number of threads with the same result. The generator is
+ * Philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3", SC 2011), keyed with
+ * the seed; counter (i / 4, r) gives the random words for values i..i+3 of row r.
+ */
+
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+void philox4x32(const unsigned int* counter, const unsigned int* key, unsigned int* out)
+{
+	int round;
+	unsigned int c0 = counter[0], c1 = counter[1], c2 = counter[2], c3 = counter[3];
+	unsigned int k0 = key[0], k1 = key[1];
+	unsigned long long p0, p1;
+	for(round=0; round<10; round++)
+	{
+		p0 = (unsigned long long)PHILOX_M0 * c0;
+		p1 = (unsigned long long)PHILOX_M1 * c2;
+		c0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+		c1 = (unsigned int)p1;
+		c2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+		c3 = (unsigned int)p0;
+		k0 += PHILOX_W0;
+		k1 += PHILOX_W1;
+	}
+	out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+/* Fill row r with values uniform in [-0.5, 0.5) / size, the range of the rand() initialization */
+void initRandomRow(real* row, int size, long long r, unsigned long long seed)
+{
+	int i, j;
+	unsigned int counter[4], key[2], out[4];
+	key[0] = (unsigned int)seed; key[1] = (unsigned int)(seed >> 32);
+	counter[2] = (unsigned int)r; counter[3] = (unsigned int)((unsigned long long)r >> 32);
+	for(i=0; i<size; i += 4)
+	{
+		counter[0] = i / 4; counter[1] = 0;
+		philox4x32(counter, key, out);
+		for(j=0; j<4 && i + j < size; j++) row[i + j] = (real)((out[j] * (1.0 / 4294967296.0) - 0.5) / size); // Computed in double for every precision
+	}
+}
@@ -0,0 +1,21 @@
+#include "helperfuncs.h"
+
+#define CONVERT_CHUNK 8192
+
+/* Read n doubles from the file into an array of reals; returns the number of values read */
+long long readReals(real* dst, long long n, FILE* fin)
+{
+	long long done = 0;
+	size_t got;
+	int i;
+	double buf[CONVERT_CHUNK];
+	if(sizeof(real) == sizeof(double)) return fread(dst, sizeof(double), n, fin);
+	while(done < n)
+	{
+		got = fread(buf, sizeof(double), (n - done < CONVERT_CHUNK) ? n - done : CONVERT_CHUNK, fin);
+		for(i=0; i<got; i++) dst[done + i] = (real)buf[i];
+		done += got;
+		if(got == 0) break;
+	}
+	return done;
+}
@@ -1,5 +1,5 @@
 #include "helperfuncs.h"
-#include <math.h>
+#include <tgmath.h> // Type-generic math, so single-precision builds call the float variants
 
 real recipCost(real val, real pol, real k)
 {
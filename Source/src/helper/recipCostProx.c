@@ -0,0 +1,24 @@
+#include "helperfuncs.h"
+#include <tgmath.h> // Type-generic math, so single-precision builds call the float variants
+
+/*
+ * Proximal step on the forced term: the value v with v = val - step * recipCostDer(v, pol, k),
+ * i.e. an implicit gradient step of size step, which stays stable when step is large.
+ * For a positive polarity the right-hand side is monotone and the root lies between val and
+ * the explicit step, so it is found by bisection; otherwise the explicit step is returned.
+ */
+real recipCostProx(real val, real step, real pol, real k)
+{
+	int i;
+	real lo = val, hi, mid;
+	hi = val - step * recipCostDer(val, pol, k);
+	if(pol <= 0 || hi <= lo) return hi;
+	for(i=0; i<100; i++)
+	{
+		mid = 0.5 * (lo + hi);
+		if(mid <= lo || mid >= hi) break;
+		if(mid - val + step * recipCostDer(mid, pol, k) < 0) lo = mid;
+		else hi = mid;
+	}
+	return hi;
+}
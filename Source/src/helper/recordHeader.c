@@ -0,0 +1,45 @@
+#include "recordfile.h"
+#include <string.h>
+
+#define RECORD_MAGIC "GLVREC"
+
+int readRecordHeader(FILE* fin, RECHDR* h)
+{
+	if(fread(h, sizeof(RECHDR), 1, fin) != 1) return -1;
+	if(memcmp(h->magic, RECORD_MAGIC, sizeof(h->magic)) != 0) return RECFMT_CREC; // Bare records: a word id is never this large
+	return h->format;
+}
+
+/* Start a record file of the given format; nothing is written for RECFMT_CREC. Returns 0 on success. */
+int writeRecordHeader(FILE* fout, int format, float x_max, float alpha)
+{
+	RECHDR h;
+	if(format == RECFMT_CREC) return 0;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, RECORD_MAGIC, sizeof(h.magic));
+	h.format = format;
+	h.x_max = x_max;
+	h.alpha = alpha;
+	return fwrite(&h, sizeof(RECHDR), 1, fout) != 1;
+}
+
+long recordSize(int format)
+{
+	switch(format)
+	{
+		case RECFMT_CREC: return 2 * sizeof(int) + sizeof(double);
+		case RECFMT_TRAIN: return sizeof(TREC);
+		case RECFMT_COMPACT: return sizeof(CRECF);
+		case RECFMT_BLOCK: return sizeof(CRECF); // Once decoded
+	}
+	return 0;
+}
+
+/* Format for a command-line name: crec (default), compact or block; -1 if unknown */
+int formatFromName(const char* name)
+{
+	if(strcmp(name, "crec") == 0) return RECFMT_CREC;
+	if(strcmp(name, "compact") == 0) return RECFMT_COMPACT;
+	if(strcmp(name, "block") == 0) return RECFMT_BLOCK;
+	return -1;
+}
@@ -0,0 +1,137 @@
+#include "recordfile.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct raw_rec { // Layout of CREC in the tools
+	int word1;
+	int word2;
+	double val;
+} RAWREC;
+
+static RECSTREAM* newStream(FILE* f, int format)
+{
+	RECSTREAM* s = malloc(sizeof(RECSTREAM));
+	s->f = f;
+	s->format = format;
+	s->count = s->pos = 0;
+	s->recs = malloc(sizeof(RAWREC) * RECBLOCK_RECORDS);
+	s->packed = malloc(sizeof(CRECF) * RECBLOCK_RECORDS);
+	s->bytes = malloc(RECBLOCK_MAX_BYTES(RECBLOCK_RECORDS));
+	return s;
+}
+
+static void freeStream(RECSTREAM* s)
+{
+	free(s->recs);
+	free(s->packed);
+	free(s->bytes);
+	free(s);
+}
+
+/* Write out the buffered records: as they are, packed, or as one block */
+static int flushRecords(RECSTREAM* s)
+{
+	RAWREC* r = (RAWREC*)s->recs;
+	RECBLOCKHDR h;
+	int i, ok;
+	if(s->pos == 0) return 0;
+	if(s->format == RECFMT_CREC) ok = fwrite(r, sizeof(RAWREC), s->pos, s->f) == s->pos;
+	else
+	{
+		for(i=0; i<s->pos; i++)
+		{
+			s->packed[i].word1 = r[i].word1;
+			s->packed[i].word2 = r[i].word2;
+			s->packed[i].val = (float)r[i].val;
+		}
+		if(s->format == RECFMT_COMPACT) ok = fwrite(s->packed, sizeof(CRECF), s->pos, s->f) == s->pos;
+		else
+		{
+			h.records = s->pos;
+			h.bytes = encodeRecordBlock(s->packed, s->pos, s->bytes);
+			ok = fwrite(&h, sizeof(h), 1, s->f) == 1 && fwrite(s->bytes, 1, h.bytes, s->f) == h.bytes;
+		}
+	}
+	s->pos = 0;
+	return !ok;
+}
+
+/* Refill the buffer with the next records (at most one block); returns how many */
+static int fillRecords(RECSTREAM* s)
+{
+	RAWREC* r = (RAWREC*)s->recs;
+	RECBLOCKHDR h;
+	int i;
+	s->pos = 0;
+	if(s->format == RECFMT_CREC) return s->count = fread(r, sizeof(RAWREC), RECBLOCK_RECORDS, s->f);
+	if(s->format == RECFMT_COMPACT) s->count = fread(s->packed, sizeof(CRECF), RECBLOCK_RECORDS, s->f);
+	else if(fread(&h, sizeof(h), 1, s->f) != 1 || h.records < 0 || h.records > RECBLOCK_RECORDS || h.bytes < 0 || h.bytes > RECBLOCK_MAX_BYTES(h.records)
+		|| fread(s->bytes, 1, h.bytes, s->f) != h.bytes) s->count = 0;
+	else
+	{
+		decodeRecordBlock(s->bytes, h.records, s->packed);
+		s->count = h.records;
+	}
+	for(i=0; i<s->count; i++)
+	{
+		r[i].word1 = s->packed[i].word1;
+		r[i].word2 = s->packed[i].word2;
+		r[i].val = s->packed[i].val;
+	}
+	return s->count;
+}
+
+RECSTREAM* openRecordWriter(FILE* f, int format)
+{
+	if(format != RECFMT_CREC && format != RECFMT_COMPACT && format != RECFMT_BLOCK) return NULL;
+	if(writeRecordHeader(f, format, 0, 0) != 0) return NULL;
+	return newStream(f, format);
+}
+
+RECSTREAM* openRecordReader(FILE* f)
+{
+	RECHDR h;
+	RECSTREAM* s;
+	int format = readRecordHeader(f, &h);
+	if(format < 0) return newStream(f, RECFMT_CREC); // Too short to hold anything: no records
+	if(format != RECFMT_CREC && format != RECFMT_COMPACT && format != RECFMT_BLOCK) return NULL;
+	s = newStream(f, format);
+	if(format == RECFMT_CREC) // The bytes read as a header were the first record
+	{
+		memcpy(s->recs, &h, sizeof(RAWREC));
+		s->count = 1;
+	}
+	return s;
+}
+
+int putRecord(RECSTREAM* s, int word1, int word2, double val)
+{
+	RAWREC* r = (RAWREC*)s->recs + s->pos++;
+	r->word1 = word1;
+	r->word2 = word2;
+	r->val = val;
+	return (s->pos == RECBLOCK_RECORDS) ? flushRecords(s) : 0;
+}
+
+int getRecord(RECSTREAM* s, int* word1, int* word2, double* val)
+{
+	RAWREC* r;
+	if(s->pos >= s->count && fillRecords(s) == 0) return 0;
+	r = (RAWREC*)s->recs + s->pos++;
+	*word1 = r->word1;
+	*word2 = r->word2;
+	*val = r->val;
+	return 1;
+}
+
+int closeRecordWriter(RECSTREAM* s)
+{
+	int err = flushRecords(s);
+	freeStream(s);
+	return err;
+}
+
+void closeRecordReader(RECSTREAM* s)
+{
+	freeStream(s);
+}
@@ -0,0 +1,199 @@
+#include "tokenizer.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SCAN
+#endif
+
+#define TOKEN_BUFFER_BYTES 4194304
+
+static wordRunFn selectWordRun(void);
+
+static TOKENREADER* newReader(int mode, int max_length)
+{
+	TOKENREADER* r = calloc(1, sizeof(TOKENREADER));
+	r->mode = mode;
+	r->max_length = max_length;
+	r->wordRun = selectWordRun();
+	return r;
+}
+
+/* Regular files are mapped from the current position on; pipes and terminals are read in buffers */
+TOKENREADER* openTokenReader(FILE* f, int mode, int max_length)
+{
+	TOKENREADER* r = newReader(mode, max_length);
+	struct stat st;
+	long long start = ftello(f);
+	void* map;
+	r->f = f;
+	if(start >= 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > start)
+	{
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+		if(map != MAP_FAILED)
+		{
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			r->mapped = st.st_size;
+			r->text = map;
+			r->pos = start;
+			r->end = st.st_size;
+			r->bytes = st.st_size - start;
+			return r;
+		}
+	}
+	r->size = TOKEN_BUFFER_BYTES;
+	r->buf = malloc(r->size);
+	r->text = r->buf;
+	return r;
+}
+
+TOKENREADER* openTokenText(const char* text, long long length, int mode, int max_length)
+{
+	TOKENREADER* r = newReader(mode, max_length);
+	r->text = text;
+	r->end = length;
+	r->bytes = length;
+	return r;
+}
+
+void closeTokenReader(TOKENREADER* r)
+{
+	if(r->mapped > 0)
+	{
+		munmap((void*)r->text, r->mapped);
+		fseeko(r->f, r->mapped, SEEK_SET); // The input is used up, as if it had been read
+	}
+	free(r->buf);
+	free(r);
+}
+
+/* Next buffer of a stream; 0 at the end of the input */
+static int refill(TOKENREADER* r)
+{
+	if(r->buf == NULL) return 0;
+	r->pos = 0;
+	r->end = fread(r->buf, 1, r->size, r->f);
+	r->bytes += r->end;
+	return r->end > 0;
+}
+
+/* Length of the run of bytes above ' ' at p, at most n: the inside of a word, up to the next white space or control character */
+static long long wordRunGeneric(const unsigned char* p, long long n)
+{
+	long long i = 0;
+	while(i < n && p[i] > ' ') i++;
+	return i;
+}
+
+#ifdef HAVE_X86_SCAN
+__attribute__((target("sse2")))
+static long long wordRunSse2(const unsigned char* p, long long n)
+{
+	long long i = 0;
+	const __m128i space = _mm_set1_epi8(' ');
+	__m128i x;
+	unsigned int m;
+	for(; i + 16 <= n; i += 16)
+	{
+		x = _mm_loadu_si128((const __m128i*)(p + i));
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_min_epu8(x, space), x)); // Bytes <= ' '
+		if(m != 0) return i + __builtin_ctz(m);
+	}
+	return i + wordRunGeneric(p + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static long long wordRunAvx2(const unsigned char* p, long long n)
+{
+	long long i = 0;
+	const __m256i space = _mm256_set1_epi8(' ');
+	__m256i x;
+	unsigned int m;
+	for(; i + 32 <= n; i += 32)
+	{
+		x = _mm256_loadu_si256((const __m256i*)(p + i));
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_min_epu8(x, space), x));
+		if(m != 0) return i + __builtin_ctz(m);
+	}
+	return i + wordRunSse2(p + i, n - i);
+}
+#endif
+
+/* The widest version of wordRun the CPU supports */
+static wordRunFn selectWordRun(void)
+{
+#ifdef HAVE_X86_SCAN
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return wordRunAvx2;
+	if(__builtin_cpu_supports("sse2")) return wordRunSse2;
+#endif
+	return wordRunGeneric;
+}
+
+int readToken(TOKENREADER* r, char* word)
+{
+	const unsigned char* p;
+	long long n, take;
+	int i = 0, c;
+	int keep = (r->mode == TOKEN_GETWORD) ? r->max_length - 2 : r->max_length; // Characters a word keeps
+	while(1)
+	{
+		if(r->pos >= r->end && !refill(r))
+		{
+			// get_word hit the end of the file inside the last word and dropped it; fscanf returns what it has
+			if(r->mode == TOKEN_SCANF && i > 0) {word[i] = 0; return TOKEN_WORD;}
+			return TOKEN_END;
+		}
+		p = (const unsigned char*)r->text + r->pos;
+		c = *p;
+		if(c > ' ')
+		{
+			n = r->wordRun(p, r->end - r->pos);
+			take = (n < keep - i) ? n : keep - i;
+			memcpy(word + i, p, take);
+			i += take;
+			if(r->mode == TOKEN_SCANF && i == keep) // The rest of the word is the next one
+			{
+				r->pos += take;
+				word[i] = 0;
+				return TOKEN_WORD;
+			}
+			r->pos += n; // get_word drops the characters beyond its limit
+			if(r->pos < r->end && (r->text[r->pos] == ' ' || r->text[r->pos] == '\t')) // The usual end of a word
+			{
+				r->pos++;
+				word[i] = 0;
+				return TOKEN_WORD;
+			}
+			continue;
+		}
+		if(r->mode == TOKEN_GETWORD)
+		{
+			if(c == 13) {r->pos++; continue;}
+			if(c == ' ' || c == '\t' || c == '\n')
+			{
+				if(i > 0) // A '\n' ending a word is left to be reported as the next token
+				{
+					if(c != '\n') r->pos++;
+					word[i] = 0;
+					return TOKEN_WORD;
+				}
+				r->pos++;
+				if(c == '\n') return TOKEN_NEWLINE;
+				continue;
+			}
+		}
+		else if(c == ' ' || (c >= '\t' && c <= '\r'))
+		{
+			r->pos++;
+			if(i > 0) {word[i] = 0; return TOKEN_WORD;}
+			continue;
+		}
+		// Any other control character is part of the word
+		if(i < keep) word[i++] = c;
+		else if(r->mode == TOKEN_SCANF) {word[i] = 0; return TOKEN_WORD;}
+		r->pos++;
+	}
+}
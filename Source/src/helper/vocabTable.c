@@ -0,0 +1,63 @@
+#include "vocabtable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+VOCABTABLE* loadVocab(const char* path)
+{
+	VOCABTABLE* v;
+	FILE* f;
+	char *text, *p, *end, *word;
+	long long bytes, capacity = 1024, e;
+	f = fopen(path, "rb");
+	if(f == NULL) return NULL;
+	fseeko(f, 0, SEEK_END);
+	bytes = ftello(f);
+	rewind(f);
+	text = malloc(bytes + 1);
+	if(text == NULL || fread(text, 1, bytes, f) != (size_t)bytes) {fclose(f); free(text); return NULL;}
+	fclose(f);
+	text[bytes] = '\0';
+	v = calloc(1, sizeof(VOCABTABLE));
+	v->hash = newWordHash(capacity);
+
+	// Tokens are separated by white space, as fscanf("%s %lld") reads them
+	v->words = malloc(sizeof(char*) * capacity);
+	v->counts = malloc(sizeof(long long) * capacity);
+	for(p = text, end = text + bytes; ; )
+	{
+		while(p < end && isspace((unsigned char)*p)) p++;
+		if(p == end) break;
+		if(v->size == capacity)
+		{
+			capacity *= 2;
+			v->words = realloc(v->words, sizeof(char*) * capacity);
+			v->counts = realloc(v->counts, sizeof(long long) * capacity);
+		}
+		word = p;
+		while(p < end && !isspace((unsigned char)*p)) p++;
+		if(p < end) *p++ = '\0';
+		e = wordHashAdd(v->hash, word);
+		if(v->hash->entries[e].value == 0) v->hash->entries[e].value = v->size + 1; // A repeated word keeps its first rank
+		v->words[v->size] = v->hash->entries[e].word;
+		v->counts[v->size++] = strtoll(p, &p, 10);
+	}
+	free(text);
+	return v;
+}
+
+void freeVocab(VOCABTABLE* v)
+{
+	if(v == NULL) return;
+	freeWordHash(v->hash);
+	free(v->words);
+	free(v->counts);
+	free(v);
+}
+
+int vocabRank(const VOCABTABLE* v, const char* word)
+{
+	long long e = wordHashFind(v->hash, word);
+	return (e >= 0) ? v->hash->entries[e].value : 0;
+}
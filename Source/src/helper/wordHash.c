@@ -0,0 +1,125 @@
+#include "wordhash.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define WORDHASH_BLOCK_BYTES 1048576
+#define SLOT_TAG(h) ((h) & 0xffffffff00000000ULL)
+
+static inline unsigned long long load64(const char* p)
+{
+	unsigned long long v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+/* Final mix of MurmurHash3 */
+static inline unsigned long long fmix64(unsigned long long h)
+{
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Multiply-and-mix hash over 8 bytes at a time, in place of the byte-at-a-time bitwisehash */
+unsigned long long wordHash(const char* word, long long length)
+{
+	unsigned long long h = 0x9e3779b97f4a7c15ULL ^ (length * 0xc2b2ae3d27d4eb4fULL), tail = 0;
+	for(; length >= 8; word += 8, length -= 8) h = (h ^ fmix64(load64(word))) * 0x9e3779b97f4a7c15ULL;
+	if(length > 0)
+	{
+		memcpy(&tail, word, length);
+		h ^= fmix64(tail);
+	}
+	return fmix64(h);
+}
+
+WORDHASH* newWordHash(long long expected)
+{
+	WORDHASH* h = calloc(1, sizeof(WORDHASH));
+	h->capacity = (expected > 16) ? expected : 16;
+	h->entries = malloc(sizeof(WORDENTRY) * h->capacity);
+	for(h->num_slots = 32; h->num_slots < 2 * h->capacity; h->num_slots *= 2);
+	h->slots = calloc(h->num_slots, sizeof(unsigned long long));
+	return h;
+}
+
+void freeWordHash(WORDHASH* h)
+{
+	int b;
+	if(h == NULL) return;
+	for(b = 0; b < h->num_blocks; b++) free(h->blocks[b]);
+	free(h->blocks);
+	free(h->entries);
+	free(h->slots);
+	free(h);
+}
+
+/* Slot of a word, or the empty slot where it would go */
+static inline long long findSlot(const WORDHASH* h, const char* word, unsigned long long hash)
+{
+	long long slot, mask = h->num_slots - 1;
+	unsigned long long s;
+	for(slot = hash & mask; (s = h->slots[slot]) != 0; slot = (slot + 1) & mask)
+		if(SLOT_TAG(s) == SLOT_TAG(hash) && strcmp(h->entries[(s & 0xffffffffULL) - 1].word, word) == 0) break;
+	return slot;
+}
+
+/* Twice the slots, refilled from the cached hashes without touching the strings */
+static void grow(WORDHASH* h)
+{
+	long long e, slot, mask;
+	free(h->slots);
+	h->num_slots *= 2;
+	mask = h->num_slots - 1;
+	h->slots = calloc(h->num_slots, sizeof(unsigned long long));
+	for(e = 0; e < h->size; e++)
+	{
+		for(slot = h->entries[e].hash & mask; h->slots[slot] != 0; slot = (slot + 1) & mask);
+		h->slots[slot] = SLOT_TAG(h->entries[e].hash) | (unsigned long long)(e + 1);
+	}
+}
+
+static char* intern(WORDHASH* h, const char* word, long long length)
+{
+	char* p;
+	if(h->block_used + length + 1 > h->block_size)
+	{
+		h->block_size = (length + 1 > WORDHASH_BLOCK_BYTES) ? length + 1 : WORDHASH_BLOCK_BYTES;
+		h->blocks = realloc(h->blocks, sizeof(char*) * (h->num_blocks + 1));
+		h->blocks[h->num_blocks++] = malloc(h->block_size);
+		h->block_used = 0;
+	}
+	p = h->blocks[h->num_blocks - 1] + h->block_used;
+	memcpy(p, word, length + 1);
+	h->block_used += length + 1;
+	return p;
+}
+
+long long wordHashAdd(WORDHASH* h, const char* word)
+{
+	long long length = strlen(word), slot, e;
+	unsigned long long hash = wordHash(word, length);
+	slot = findSlot(h, word, hash);
+	if(h->slots[slot] != 0) return (h->slots[slot] & 0xffffffffULL) - 1;
+	if(h->size == h->capacity)
+	{
+		h->capacity *= 2;
+		h->entries = realloc(h->entries, sizeof(WORDENTRY) * h->capacity);
+	}
+	e = h->size++;
+	h->entries[e].word = intern(h, word, length);
+	h->entries[e].value = 0;
+	h->entries[e].hash = hash;
+	if(2 * h->size > h->num_slots) grow(h);
+	else h->slots[slot] = SLOT_TAG(hash) | (unsigned long long)(e + 1);
+	return e;
+}
+
+long long wordHashFind(const WORDHASH* h, const char* word)
+{
+	unsigned long long s = h->slots[findSlot(h, word, wordHash(word, strlen(word)))];
+	return (s != 0) ? (long long)(s & 0xffffffffULL) - 1 : -1;
+}
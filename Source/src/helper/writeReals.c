@@ -0,0 +1,22 @@
+#include "helperfuncs.h"
+
+#define CONVERT_CHUNK 8192
+
+/* Write n reals to the file as doubles; returns the number of values written */
+long long writeReals(real* src, long long n, FILE* fout)
+{
+	long long done = 0;
+	size_t put;
+	int i, len;
+	double buf[CONVERT_CHUNK];
+	if(sizeof(real) == sizeof(double)) return fwrite(src, sizeof(double), n, fout);
+	while(done < n)
+	{
+		len = (n - done < CONVERT_CHUNK) ? n - done : CONVERT_CHUNK;
+		for(i=0; i<len; i++) buf[i] = src[done + i];
+		put = fwrite(buf, sizeof(double), len, fout);
+		done += put;
+		if(put < len) break;
+	}
+	return done;
+}
@@ -24,6 +24,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
+#include "recordfile.h"
 
 #define MAX_STRING_LENGTH 1000
 
@@ -40,6 +42,9 @@ int verbose = 2; // 0, 1, or 2
 long long array_size = 2000000; // size of chunks to shuffle individually
 char *file_head; // temporary file string
 real memory_limit = 2.0; // soft limit, in gigabytes
+int precompute = 0; // 1: write TREC training records, with log X and f(X) computed once here instead of in every training iteration
+real x_max = 100.0, alpha = 0.75; // Weighting function parameters for precompute; must match those used for training
+int record_format = RECFMT_CREC; // Format of the input, detected from its header; also used for the temporary files and (without precompute) the output
 
 /* Efficient string comparison */
 int scmp( char *s1, char *s2 ) {
@@ -59,9 +64,23 @@ static long rand_long(long n) {
 }
 
 /* Write contents of array to binary file */
-int write_chunk(CREC *array, long size, FILE *fout) {
+int write_chunk(CREC *array, long size, RECSTREAM *fout) {
     long i = 0;
-    for(i = 0; i < size; i++) fwrite(&array[i], sizeof(CREC), 1, fout);
+    for(i = 0; i < size; i++) putRecord(fout, array[i].word1, array[i].word2, array[i].val);
+    return 0;
+}
+
+/* Write contents of array to binary file as training records */
+int write_train_chunk(CREC *array, long size, FILE *fout) {
+    long i;
+    TREC tr;
+    for(i = 0; i < size; i++) {
+        tr.word1 = array[i].word1;
+        tr.word2 = array[i].word2;
+        tr.logx = log(array[i].val);
+        tr.fx = (array[i].val > x_max) ? 1 : pow(array[i].val / x_max, alpha);
+        fwrite(&tr, sizeof(TREC), 1, fout);
+    }
     return 0;
 }
 
@@ -84,9 +103,13 @@ int shuffle_merge(int num) {
     CREC *array;
     char filename[MAX_STRING_LENGTH];
     FILE **fid, *fout = stdout;
+    RECSTREAM **rid, *rout = NULL;
+    char *done;
     
     array = malloc(sizeof(CREC) * array_size);
-    fid = malloc(sizeof(FILE) * num);
+    fid = malloc(sizeof(FILE *) * num);
+    rid = malloc(sizeof(RECSTREAM *) * num);
+    done = calloc(num, sizeof(char));
     for(fidcounter = 0; fidcounter < num; fidcounter++) { //num = number of temporary files to merge
         sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
         fid[fidcounter] = fopen(filename, "rb");
@@ -94,33 +117,41 @@ int shuffle_merge(int num) {
             fprintf(stderr, "Unable to open file %s.\n",filename);
             return 1;
         }
+        rid[fidcounter] = openRecordReader(fid[fidcounter]);
     }
+    if(precompute) writeRecordHeader(fout, RECFMT_TRAIN, x_max, alpha);
+    else rout = openRecordWriter(fout, record_format);
     if(verbose > 0) fprintf(stderr, "Merging temp files: processed %ld lines.", l);
     
     while(1) { //Loop until EOF in all files
         i = 0;
         //Read at most array_size values into array, roughly array_size/num from each temp file
         for(j = 0; j < num; j++) {
-            if(feof(fid[j])) continue;
+            if(done[j]) continue;
             for(k = 0; k < array_size / num; k++){
-                fread(&array[i], sizeof(CREC), 1, fid[j]);
-                if(feof(fid[j])) break;
+                if(!getRecord(rid[j], &array[i].word1, &array[i].word2, &array[i].val)) {done[j] = 1; break;}
                 i++;
             }
         }
         if(i == 0) break;
         l += i;
         shuffle(array, i-1); // Shuffles lines between temp files
-        write_chunk(array,i,fout);
+        if(precompute) write_train_chunk(array,i,fout);
+        else write_chunk(array,i,rout);
         if(verbose > 0) fprintf(stderr, "\033[31G%ld lines.", l);
     }
     fprintf(stderr, "\033[0GMerging temp files: processed %ld lines.", l);
+    if(rout != NULL) closeRecordWriter(rout);
     for(fidcounter = 0; fidcounter < num; fidcounter++) {
+        closeRecordReader(rid[fidcounter]);
         fclose(fid[fidcounter]);
         sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
         remove(filename);
     }
     fprintf(stderr, "\n\n");
+    free(rid);
+    free(fid);
+    free(done);
     free(array);
     return 0;
 }
@@ -132,9 +163,13 @@ int shuffle_by_chunks() {
     char filename[MAX_STRING_LENGTH];
     CREC *array;
     FILE *fin = stdin, *fid;
+    RECSTREAM *rin, *rtmp;
     array = malloc(sizeof(CREC) * array_size);
     
     fprintf(stderr,"SHUFFLING COOCCURRENCES\n");
+    rin = openRecordReader(fin);
+    if(rin == NULL) {fprintf(stderr, "Unsupported input format; training records cannot be shuffled again.\n"); return 1;}
+    record_format = rin->format;
     if(verbose > 0) fprintf(stderr,"array size: %lld\n", array_size);
     sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
     fid = fopen(filename,"w");
@@ -142,6 +177,7 @@ int shuffle_by_chunks() {
         fprintf(stderr, "Unable to open file %s.\n",filename);
         return 1;
     }
+    rtmp = openRecordWriter(fid, record_format);
     if(verbose > 1) fprintf(stderr, "Shuffling by chunks: processed 0 lines.");
     
     while(1) { //Continue until EOF
@@ -149,7 +185,8 @@ int shuffle_by_chunks() {
             shuffle(array, i-2);
             l += i;
             if(verbose > 1) fprintf(stderr, "\033[22Gprocessed %ld lines.", l);
-            write_chunk(array,i,fid);
+            write_chunk(array,i,rtmp);
+            closeRecordWriter(rtmp);
             fclose(fid);
             fidcounter++;
             sprintf(filename,"%s_%04d.bin",file_head, fidcounter);
@@ -158,14 +195,16 @@ int shuffle_by_chunks() {
                 fprintf(stderr, "Unable to open file %s.\n",filename);
                 return 1;
             }
+            rtmp = openRecordWriter(fid, record_format);
             i = 0;
         }
-        fread(&array[i], sizeof(CREC), 1, fin);
-        if(feof(fin)) break;
+        if(!getRecord(rin, &array[i].word1, &array[i].word2, &array[i].val)) break;
         i++;
     }
     shuffle(array, i-1); //Last chunk may be smaller than array_size
-    write_chunk(array,i,fid);
+    write_chunk(array,i,rtmp);
+    closeRecordWriter(rtmp);
+    closeRecordReader(rin);
     l += i;
     if(verbose > 1) fprintf(stderr, "\033[22Gprocessed %ld lines.\n", l);
     if(verbose > 1) fprintf(stderr, "Wrote %d temporary file(s).\n", fidcounter + 1);
@@ -204,15 +243,26 @@ int main(int argc, char **argv) {
         printf("\t\tLimit to length <int> the buffer which stores chunks of data to shuffle before writing to disk. \n\t\tThis value overrides that which is automatically produced by '-memory'.\n");
         printf("\t-temp-file <file>\n");
         printf("\t\tFilename, excluding extension, for temporary files; default temp_shuffle\n");
+        printf("\t-precompute <int>\n");
+        printf("\t\tWrite training records holding log(X) and the weight f(X) instead of the raw counts, so glove_imbue need not compute them every iteration; default 0 (off)\n");
+        printf("\t-x-max <float>\n");
+        printf("\t\tParameter specifying cutoff in weighting function for -precompute; default 100.0\n");
+        printf("\t-alpha <float>\n");
+        printf("\t\tParameter in exponent of weighting function for -precompute; default 0.75\n");
         
+        printf("\nThe input format (crec, compact or block, see 'cooccur -format') is detected and kept for the output.\n");
         printf("\nExample usage: (assuming 'cooccurrence.bin' has been produced by 'coccur')\n");
         printf("./shuffle -verbose 2 -memory 8.0 < cooccurrence.bin > cooccurrence.shuf.bin\n");
+        printf("./shuffle -verbose 2 -memory 8.0 -precompute 1 -x-max 100.0 -alpha 0.75 < cooccurrence.bin > cooccurrence.shuf.bin\n");
         return 0;
     }
    
     if ((i = find_arg((char *)"-verbose", argc, argv)) > 0) verbose = atoi(argv[i + 1]);
     if ((i = find_arg((char *)"-temp-file", argc, argv)) > 0) strcpy(file_head, argv[i + 1]);
     else strcpy(file_head, (char *)"temp_shuffle");
+    if ((i = find_arg((char *)"-precompute", argc, argv)) > 0) precompute = atoi(argv[i + 1]);
+    if ((i = find_arg((char *)"-x-max", argc, argv)) > 0) x_max = atof(argv[i + 1]);
+    if ((i = find_arg((char *)"-alpha", argc, argv)) > 0) alpha = atof(argv[i + 1]);
     if ((i = find_arg((char *)"-memory", argc, argv)) > 0) memory_limit = atof(argv[i + 1]);
     array_size = (long long) (0.95 * (real)memory_limit * 1073741824/(sizeof(CREC)));
     if ((i = find_arg((char *)"-array-size", argc, argv)) > 0) array_size = atoll(argv[i + 1]);
@@ -25,23 +25,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include "tokenizer.h"
+#include "wordhash.h"
 
 #define MAX_STRING_LENGTH 1000
-#define TSIZE	1048576
-#define SEED	1159241
-#define HASHFN  bitwisehash
 
 typedef struct vocabulary {
     char *word;
     long long count;
 } VOCAB;
 
-typedef struct hashrec {
-    char *word;
-    long long count;
-    struct hashrec *next;
-} HASHREC;
-
 int verbose = 2; // 0, 1, or 2
 long long min_count = 1; // min occurrences for inclusion in vocab
 long long max_vocab = 0; // max_vocab = 0 for no limit
@@ -69,86 +63,33 @@ int CompareVocab(const void *a, const void *b) {
     else return 0;
 }
 
-/* Move-to-front hashing and hash function from Hugh Williams, http://www.seg.rmit.edu.au/code/zwh-ipl/ */
-
-/* Simple bitwise hash function */
-unsigned int bitwisehash(char *word, int tsize, unsigned int seed) {
-    char c;
-    unsigned int h;
-    h = seed;
-    for(; (c =* word) != '\0'; word++) h ^= ((h << 5) + c + (h >> 2));
-    return((unsigned int)((h&0x7fffffff) % tsize));
-}
-
-/* Create hash table, initialise pointers to NULL */
-HASHREC ** inithashtable() {
-    int	i;
-    HASHREC **ht;
-    ht = (HASHREC **) malloc( sizeof(HASHREC *) * TSIZE );
-    for(i = 0; i < TSIZE; i++) ht[i] = (HASHREC *) NULL;
-    return(ht);
-}
-
-/* Search hash table for given string, insert if not found */
-void hashinsert(HASHREC **ht, char *w) {
-    HASHREC	*htmp, *hprv;
-    unsigned int hval = HASHFN(w, TSIZE, SEED);
-    
-    for(hprv = NULL, htmp = ht[hval]; htmp != NULL && scmp(htmp->word, w) != 0; hprv = htmp, htmp = htmp->next);
-    if(htmp == NULL) {
-        htmp = (HASHREC *) malloc( sizeof(HASHREC) );
-        htmp->word = (char *) malloc( strlen(w) + 1 );
-        strcpy(htmp->word, w);
-        htmp->count = 1;
-        htmp->next = NULL;
-        if( hprv==NULL )
-            ht[hval] = htmp;
-        else
-            hprv->next = htmp;
-    }
-    else {
-        /* new records are not moved to front */
-        htmp->count++;
-        if(hprv != NULL) {
-            /* move to front on access */
-            hprv->next = htmp->next;
-            htmp->next = ht[hval];
-            ht[hval] = htmp;
-        }
-    }
-    return;
-}
-
 int get_counts() {
-    long long i = 0, j = 0, vocab_size = 12500;
-    char format[20];
+    long long i = 0, j = 0, slot, e;
     char str[MAX_STRING_LENGTH + 1];
-    HASHREC **vocab_hash = inithashtable();
-    HASHREC *htmp;
+    WORDHASH *vocab_hash = newWordHash(1048576);
     VOCAB *vocab;
-    FILE *fid = stdin;
+    TOKENREADER *tokens = openTokenReader(stdin, TOKEN_SCANF, MAX_STRING_LENGTH); // Words as fscanf("%1000s") reads them
+    struct timespec start, end;
     
     fprintf(stderr, "BUILDING VOCABULARY\n");
     if(verbose > 1) fprintf(stderr, "Processed %lld tokens.", i);
-    sprintf(format,"%%%ds",MAX_STRING_LENGTH);
-    while(fscanf(fid, format, str) != EOF) { // Insert all tokens into hashtable
-        hashinsert(vocab_hash, str);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(readToken(tokens, str) != TOKEN_END) { // Insert all tokens into hashtable
+        e = wordHashAdd(vocab_hash, str); // May move the entries
+        vocab_hash->entries[e].value++;
         if(((++i)%100000) == 0) if(verbose > 1) fprintf(stderr,"\033[11G%lld tokens.", i);
     }
-    if(verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens.\n", i);
-    vocab = malloc(sizeof(VOCAB) * vocab_size);
-    for(i = 0; i < TSIZE; i++) { // Migrate vocab to array
-        htmp = vocab_hash[i];
-        while (htmp != NULL) {
-            vocab[j].word = htmp->word;
-            vocab[j].count = htmp->count;
-            j++;
-            if(j>=vocab_size) {
-                vocab_size += 2500;
-                vocab = (VOCAB *)realloc(vocab, sizeof(VOCAB) * vocab_size);
-            }
-            htmp = htmp->next;
-        }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if(verbose > 1) fprintf(stderr, "\033[0GProcessed %lld tokens (%.1f MB at %.2f GB/s).\n", i, tokens->bytes / 1e6,
+        tokens->bytes / 1e9 / (end.tv_sec - start.tv_sec + 1e-9 * (end.tv_nsec - start.tv_nsec) + 1e-9));
+    closeTokenReader(tokens);
+    vocab = malloc(sizeof(VOCAB) * (vocab_hash->size + 1));
+    for(slot = 0; slot < vocab_hash->num_slots; slot++) { // Migrate vocab to array, in the (pseudo-random) order of the hash slots
+        if(vocab_hash->slots[slot] == 0) continue;
+        e = (vocab_hash->slots[slot] & 0xffffffffULL) - 1;
+        vocab[j].word = vocab_hash->entries[e].word;
+        vocab[j].count = vocab_hash->entries[e].value;
+        j++;
     }
     if(verbose > 1) fprintf(stderr, "Counted %lld unique words.\n", j);
     if(max_vocab > 0 && max_vocab < j)